@@ -1,4 +1,5 @@
 #include "GameField.h"
+#include "xoshiro.h"
 
 std::string act_to_str(int act)
 {
@@ -45,16 +46,15 @@ bool out_field(int pos, int index)
 	return false;
 }
 
-std::vector<double> get_noise(int num)
+std::vector<double> get_noise(int num, double alpha)
 {
-	std::mt19937 g;
-	double k = 1;
-	double theta = 1;
+	// dirichlet sample from normalized gammas
+	auto& g = get_thread_rng();
+	std::gamma_distribution<> d(alpha, 1);
 	double sm = 0;
 	auto res = std::vector<double>(num, 0);
 	for (int i = 0; i < num; i++)
 	{
-		std::gamma_distribution<> d(k, theta);
 		res[i] = d(g);
 		sm += res[i];
 	}
@@ -77,6 +77,15 @@ GameField::GameField(const GameField& field)
 	this->past_situation_map = field.past_situation_map;
 }
 
+GameField& GameField::operator=(const GameField& field)
+{
+	this->gameField = field.gameField;
+	this->pass_cnt = field.pass_cnt;
+	this->current_color = field.current_color;
+	this->past_situation_map = field.past_situation_map;
+	return *this;
+}
+
 void GameField::clear()
 {
 	this->gameField = empty_field;
@@ -400,3 +409,57 @@ std::vector<double> GameField::get_gamefield_mat()
 	}
 	return input_vector;
 }
+
+void GameField::save(std::ostream& out) const
+{
+	auto write_int = [&out](int32_t x) { out.write(reinterpret_cast<const char*>(&x), sizeof(x)); };
+	auto write_board = [&](const board_type& board)
+	{
+		write_int(board.size());
+		for (auto l : board) write_int(l);
+	};
+
+	write_board(gameField);
+	write_int(pass_cnt);
+	write_int(current_color);
+
+	write_int(past_situation_map.size());
+	for (const auto& situation : past_situation_map)
+	{
+		write_board(situation.first.first);
+		write_int(situation.first.second);
+		write_int(situation.second);
+	}
+}
+
+void GameField::load(std::istream& in)
+{
+	auto read_int = [&in]()
+	{
+		int32_t x = 0;
+		in.read(reinterpret_cast<char*>(&x), sizeof(x));
+		if (!in) throw std::runtime_error("unexpected end of game field");
+		return x;
+	};
+	auto read_board = [&]()
+	{
+		int size = read_int();
+		if (size != ALL) throw std::runtime_error("bad game field size");
+		board_type board(size);
+		for (auto& l : board) l = read_int();
+		return board;
+	};
+
+	gameField = read_board();
+	pass_cnt = read_int();
+	current_color = read_int();
+
+	past_situation_map.clear();
+	int situation_cnt = read_int();
+	for (int i = 0; i < situation_cnt; i++)
+	{
+		auto board = read_board();
+		int color = read_int();
+		past_situation_map[{board, color}] = read_int() != 0;
+	}
+}
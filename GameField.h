@@ -14,6 +14,8 @@
 #include <sstream>
 #include <algorithm>
 #include <exception>
+#include <stdexcept>
+#include <cstdint>
 
 const double THRESHOLD = 32.75;
 const int WIDTH = 8;
@@ -52,7 +54,7 @@ extern bool str_valid(std::string str);
 extern std::pair<int, int> act_to_xy(int act);
 extern int xy_to_act(int x, int y);
 extern bool out_field(int pos, int index);
-extern std::vector<double> get_noise(int num);
+extern std::vector<double> get_noise(int num, double alpha = 1);
 
 class GameField
 {
@@ -66,6 +68,7 @@ public:
 
 	GameField();
 	GameField(const GameField&);
+	GameField& operator=(const GameField&);
 
 	void clear();
 	void destroy();
@@ -86,4 +89,8 @@ public:
 	void play(std::string act_str, int color);
 	void play(int pos);
 	void play(std::string act_str);
+
+	// binary serialisation, used by the tree snapshots
+	void save(std::ostream& out) const;
+	void load(std::istream& in);
 };
\ No newline at end of file
@@ -1,15 +1,19 @@
 #include <cmath>
 #include <cfloat>
+#include <climits>
 #include <numeric>
 #include <iostream>
+#include <fstream>
 
 #include "MCTS.h"
+#include "xoshiro.h"
 
 // TreeNode
 TreeNode::TreeNode()
     : parent(nullptr),
     is_leaf(true),
     virtual_loss(0),
+    in_flight(false),
     n_visited(0),
     p_sa(0),
     q_sa(0) {}
@@ -19,6 +23,7 @@ TreeNode::TreeNode(TreeNode* parent, double p_sa, unsigned int action_size)
     children(action_size, nullptr),
     is_leaf(true),
     virtual_loss(0),
+    in_flight(false),
     n_visited(0),
     q_sa(0),
     p_sa(p_sa) {}
@@ -35,6 +40,7 @@ TreeNode::TreeNode(
     this->q_sa = node.q_sa;
 
     this->virtual_loss.store(node.virtual_loss.load());
+    this->in_flight.store(node.in_flight.load());
 }
 
 TreeNode& TreeNode::operator=(const TreeNode& node) {
@@ -51,6 +57,7 @@ TreeNode& TreeNode::operator=(const TreeNode& node) {
     this->p_sa = node.p_sa;
     this->q_sa = node.q_sa;
     this->virtual_loss.store(node.virtual_loss.load());
+    this->in_flight.store(node.in_flight.load());
 
     return *this;
 }
@@ -82,7 +89,8 @@ unsigned int TreeNode::select(double c_puct, double c_virtual_loss) {
     return best_move;
 }
 
-void TreeNode::expand(const std::vector<double>& action_priors) {
+unsigned int TreeNode::expand(const std::vector<double>& action_priors) {
+    unsigned int created = 0;
     {
         // get lock
         std::lock_guard<std::mutex> lock(this->lock);
@@ -96,12 +104,14 @@ void TreeNode::expand(const std::vector<double>& action_priors) {
                     continue;
                 }
                 this->children[i] = new TreeNode(this, action_priors[i], action_size);
+                created++;
             }
 
             // not leaf
             this->is_leaf = false;
         }
     }
+    return created;
 }
 
 void TreeNode::backup(double value) {
@@ -124,6 +134,13 @@ void TreeNode::backup(double value) {
     }
 }
 
+void TreeNode::revert_virtual_loss() {
+    // undo the virtual loss select added along the path
+    for (auto node = this; node->parent != nullptr; node = node->parent) {
+        node->virtual_loss--;
+    }
+}
+
 double TreeNode::get_value(double c_puct, double c_virtual_loss,
     unsigned int sum_n_visited) const {
     // u
@@ -142,72 +159,983 @@ double TreeNode::get_value(double c_puct, double c_virtual_loss,
     }
 }
 
+// TreeReclaimer
+TreeReclaimer::TreeReclaimer() : running(true) {
+    this->worker = std::make_unique<std::thread>([this] {
+        while (true) {
+            std::vector<tree_type> trees;
+
+            // take every pending subtree at once
+            {
+                std::unique_lock<std::mutex> lock(this->lock);
+                this->cv.wait(lock, [this] {
+                    return this->trees.size() > 0 || !this->running;
+                });
+
+                if (!this->running && this->trees.empty())
+                    return;
+
+                trees.swap(this->trees);
+            }
+
+            for (auto& tree : trees) {
+                long long deleted = MCTS::delete_tree(tree.first);
+                if (tree.second != nullptr) {
+                    *tree.second -= deleted;
+                }
+            }
+        }
+    });
+}
+
+TreeReclaimer::~TreeReclaimer() {
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        this->running = false;
+    }
+    this->cv.notify_all();
+    this->worker->join();
+}
+
+void TreeReclaimer::reclaim(TreeNode* tree,
+    std::shared_ptr<std::atomic<long long>> node_count) {
+    if (tree == nullptr) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        this->trees.emplace_back(tree, std::move(node_count));
+    }
+    this->cv.notify_one();
+}
+
+TreeReclaimer& TreeReclaimer::get_instance() {
+    static TreeReclaimer reclaimer;
+    return reclaimer;
+}
+
 // MCTS
 MCTS::MCTS(NeuralNetwork* neural_network, unsigned int thread_num, double c_puct,
     unsigned int num_mcts_sims, double c_virtual_loss,
     unsigned int action_size)
     : neural_network(neural_network),
-    thread_pool(new ThreadPool(thread_num)),
+    thread_num(thread_num),
+    early_stop(false),
+    root_parallel(false),
+    coroutine_leaves(0),
+    coroutines_in_flight(0),
+    use_noise(true),
+    root_noise_added(false),
+    gather_size(1),
+    stop_search(false),
     c_puct(c_puct),
     num_mcts_sims(num_mcts_sims),
     c_virtual_loss(c_virtual_loss),
     action_size(action_size),
-    root(new TreeNode(nullptr, 1., action_size), MCTS::tree_deleter) {}
+    root(new TreeNode(nullptr, 1., action_size), MCTS::tree_deleter),
+    node_count(std::make_shared<std::atomic<long long>>(1)),
+    node_limit(0) {
+    this->reset_search_stats();
+}
+
+MCTS::~MCTS() {
+    this->stop_ponder();
+    TreeReclaimer::get_instance().reclaim(this->root.release(), this->node_count);
+    for (auto& tree : this->worker_roots) {
+        TreeReclaimer::get_instance().reclaim(tree.release(), this->node_count);
+    }
+}
 
 void MCTS::update_with_move(int last_action) {
-    auto old_root = this->root.get();
+    this->root.reset(this->advance_root(this->root.release(), last_action));
+    for (auto& tree : this->worker_roots) {
+        tree.reset(this->advance_root(tree.release(), last_action));
+    }
+    this->root_noise_added = false;
+}
+
+TreeNode* MCTS::advance_root(TreeNode* old_root, int last_action) {
+    TreeNode* new_root;
 
     // reuse the child tree
     if (last_action >= 0 && old_root->children[last_action] != nullptr) {
         // unlink
-        TreeNode* new_node = old_root->children[last_action];
+        new_root = old_root->children[last_action];
         old_root->children[last_action] = nullptr;
-        new_node->parent = nullptr;
-
-        this->root.reset(new_node);
+        new_root->parent = nullptr;
     }
     else {
-        this->root.reset(new TreeNode(nullptr, 1., this->action_size));
+        new_root = new TreeNode(nullptr, 1., this->action_size);
+        (*this->node_count)++;
     }
+
+    // the old root is deleted by the reclaimer, not on the critical path
+    TreeReclaimer::get_instance().reclaim(old_root, this->node_count);
+    return new_root;
 }
 
 void MCTS::tree_deleter(TreeNode* t) {
+    delete_tree(t);
+}
+
+long long MCTS::delete_tree(TreeNode* t) {
     if (t == nullptr) {
-        return;
+        return 0;
     }
 
     // remove children
+    long long deleted = 1;
     for (unsigned int i = 0; i < t->children.size(); i++) {
         if (t->children[i]) {
-            tree_deleter(t->children[i]);
+            deleted += delete_tree(t->children[i]);
         }
     }
 
     // remove self
     delete t;
+    return deleted;
 }
 
-std::vector<double> MCTS::get_action_probs(GameField* g, double temp) {
-    // submit simulate tasks to thread_pool
-    std::vector<std::future<void>> futures;
+void MCTS::set_memory_limit(long long bytes) {
+    this->node_limit = bytes / this->get_node_bytes();
+}
 
-    for (unsigned int i = 0; i < this->num_mcts_sims; i++) {
-        // copy gomoku
-        auto game = std::make_shared<GameField>(*g);
-        auto future =
-            this->thread_pool->commit(std::bind(&MCTS::simulate, this, game, true));
+long long MCTS::get_node_bytes() const {
+    return sizeof(TreeNode) + this->action_size * sizeof(TreeNode*);
+}
+
+bool MCTS::tree_full() const {
+    return this->node_limit > 0 && this->node_count->load() >= this->node_limit;
+}
+
+bool MCTS::can_expand(const TreeNode* node) const {
+    // roots are expanded even when full, every search needs their priors
+    return node->parent == nullptr || !this->tree_full();
+}
+
+long long MCTS::count_nodes(TreeNode* t) {
+    long long cnt = 1;
+    for (auto child : t->children) {
+        if (child != nullptr) {
+            cnt += count_nodes(child);
+        }
+    }
+    return cnt;
+}
+
+void MCTS::prune_tree() {
+    if (this->node_limit <= 0 ||
+        this->node_count->load() < this->node_limit * PRUNE_TRIGGER) {
+        return;
+    }
+
+    // the private trees of a root-parallel search count against the cap too
+    std::vector<TreeNode*> trees{ this->root.get() };
+    for (auto& tree : this->worker_roots) {
+        trees.emplace_back(tree.get());
+    }
+
+    // the counter may still include subtrees the reclaimer hasn't freed
+    long long live = 0;
+    unsigned int max_visits = 0;
+    for (auto tree : trees) {
+        live += count_nodes(tree);
+        max_visits = std::max(max_visits, tree->n_visited.load());
+    }
+    long long target = static_cast<long long>(this->node_limit * PRUNE_TARGET);
+
+    // drop the subtrees below the least visited nodes first
+    unsigned int threshold = 1;
+    while (live > target && threshold <= max_visits) {
+        for (auto tree : trees) {
+            live -= this->prune_children(tree, threshold);
+        }
+        threshold *= 2;
+    }
+}
+
+long long MCTS::prune_children(TreeNode* node, unsigned int threshold) {
+    long long pruned = 0;
+
+    for (auto child : node->children) {
+        if (child == nullptr || child->is_leaf) {
+            continue;
+        }
+
+        if (child->n_visited.load() > threshold) {
+            pruned += this->prune_children(child, threshold);
+            continue;
+        }
+
+        // turn the child back into a leaf, it is expanded again if visited
+        for (auto& grandchild : child->children) {
+            if (grandchild != nullptr) {
+                long long cnt = count_nodes(grandchild);
+                *this->node_count -= cnt;
+                pruned += cnt;
+
+                TreeReclaimer::get_instance().reclaim(grandchild);
+                grandchild = nullptr;
+            }
+        }
+        child->is_leaf = true;
+    }
+
+    return pruned;
+}
+
+// snapshot layout: magic, version, action size, root position, then the
+// nodes in preorder as p, q, n, is_leaf and the actions of their children
+static const char TREE_MAGIC[4] = { 'M', 'C', 'T', 'S' };
+static const uint32_t TREE_VERSION = 1;
+
+template <class T>
+static void write_pod(std::ostream& out, const T& x) {
+    out.write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+template <class T>
+static T read_pod(std::istream& in) {
+    T x;
+    in.read(reinterpret_cast<char*>(&x), sizeof(T));
+    if (!in) {
+        throw std::runtime_error("unexpected end of tree snapshot");
+    }
+    return x;
+}
+
+void MCTS::save_tree(const std::string& path, GameField* g) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("can't open " + path);
+    }
+
+    out.write(TREE_MAGIC, sizeof(TREE_MAGIC));
+    write_pod<uint32_t>(out, TREE_VERSION);
+    write_pod<uint32_t>(out, this->action_size);
+    g->save(out);
+    save_node(out, this->root.get(), this->root->p_sa,
+        this->root_noise_added ? &this->root_priors : nullptr);
+}
+
+void MCTS::save_node(std::ostream& out, TreeNode* node, double p_sa,
+    const std::vector<double>* child_priors) {
+    write_pod<double>(out, p_sa);
+    write_pod<double>(out, node->q_sa);
+    write_pod<uint32_t>(out, node->n_visited.load());
+    write_pod<uint8_t>(out, node->is_leaf);
+
+    std::vector<uint8_t> actions;
+    for (unsigned int i = 0; i < node->children.size(); i++) {
+        if (node->children[i] != nullptr) {
+            actions.emplace_back(i);
+        }
+    }
+
+    write_pod<uint8_t>(out, actions.size());
+    for (auto action : actions) {
+        write_pod<uint8_t>(out, action);
+        save_node(out, node->children[action], child_priors != nullptr ?
+            (*child_priors)[action] : node->children[action]->p_sa);
+    }
+}
+
+GameField MCTS::load_tree(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("can't open " + path);
+    }
+
+    char magic[sizeof(TREE_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic + sizeof(magic), TREE_MAGIC)) {
+        throw std::runtime_error(path + " is not a tree snapshot");
+    }
+    if (read_pod<uint32_t>(in) != TREE_VERSION) {
+        throw std::runtime_error("unsupported tree snapshot version");
+    }
+    if (read_pod<uint32_t>(in) != this->action_size) {
+        throw std::runtime_error("tree snapshot action size mismatch");
+    }
 
-        // future can't copy
-        futures.emplace_back(std::move(future));
+    GameField g;
+    g.load(in);
+
+    std::unique_ptr<TreeNode, decltype(MCTS::tree_deleter)*> new_root(
+        this->load_node(in, nullptr), MCTS::tree_deleter);
+
+    // replace the tree only once the whole file is read
+    TreeReclaimer::get_instance().reclaim(this->root.release(), this->node_count);
+    this->root = std::move(new_root);
+    *this->node_count += count_nodes(this->root.get());
+
+    // private trees belong to the old position
+    for (auto& tree : this->worker_roots) {
+        TreeReclaimer::get_instance().reclaim(tree.release(), this->node_count);
+    }
+    this->worker_roots.clear();
+    this->root_noise_added = false;
+
+    return g;
+}
+
+TreeNode* MCTS::load_node(std::istream& in, TreeNode* parent) {
+    std::unique_ptr<TreeNode, decltype(MCTS::tree_deleter)*> node(
+        new TreeNode(parent, 0, this->action_size), MCTS::tree_deleter);
+
+    node->p_sa = read_pod<double>(in);
+    node->q_sa = read_pod<double>(in);
+    node->n_visited.store(read_pod<uint32_t>(in));
+    node->is_leaf = read_pod<uint8_t>(in) != 0;
+
+    unsigned int child_cnt = read_pod<uint8_t>(in);
+    for (unsigned int i = 0; i < child_cnt; i++) {
+        unsigned int action = read_pod<uint8_t>(in);
+        if (action >= this->action_size || node->children[action] != nullptr) {
+            throw std::runtime_error("corrupted tree snapshot");
+        }
+        node->children[action] = this->load_node(in, node.get());
+    }
+
+    return node.release();
+}
+
+void MCTS::reset_search_stats() {
+    this->search_begin = std::chrono::steady_clock::now();
+    this->search_end = this->search_begin;
+    this->stat_nn_evals = 0;
+    this->stat_terminal_hits = 0;
+    this->stat_collisions = 0;
+    this->stat_depth_sum = 0;
+    this->stat_max_depth = 0;
+    this->stat_wait_ns = 0;
+}
+
+void MCTS::record_depth(TreeNode* leaf) {
+    unsigned int depth = 0;
+    for (auto node = leaf; node->parent != nullptr; node = node->parent) {
+        depth++;
     }
 
-    // wait simulate
-    for (unsigned int i = 0; i < futures.size(); i++) {
-        futures[i].wait();
+    this->stat_depth_sum += depth;
+
+    unsigned int max_depth = this->stat_max_depth.load();
+    while (depth > max_depth &&
+        !this->stat_max_depth.compare_exchange_weak(max_depth, depth)) {
     }
+}
+
+SearchStats MCTS::get_search_stats() const {
+    SearchStats stats;
+
+    stats.nn_evals = this->stat_nn_evals.load();
+    stats.terminal_hits = this->stat_terminal_hits.load();
+    stats.simulations = stats.nn_evals + stats.terminal_hits;
+    stats.seconds = std::chrono::duration<double>(
+        this->search_end - this->search_begin).count();
+    stats.sims_per_second = stats.seconds > 0 ? stats.simulations / stats.seconds : 0;
+    stats.mean_depth = stats.simulations > 0 ?
+        double(this->stat_depth_sum.load()) / stats.simulations : 0;
+    stats.max_depth = this->stat_max_depth.load();
+    stats.wait_seconds = this->stat_wait_ns.load() * 1e-9;
+    stats.collisions = this->stat_collisions.load();
+    stats.node_count = this->node_count->load();
+    stats.node_bytes = stats.node_count * this->get_node_bytes();
+
+    return stats;
+}
+
+std::string SearchStats::to_string() const {
+    std::ostringstream out;
+    out << "sims: " << this->simulations
+        << " time: " << this->seconds << "s"
+        << " sims/s: " << this->sims_per_second
+        << " depth: " << this->mean_depth << "/" << this->max_depth
+        << " nn: " << this->nn_evals
+        << " terminal: " << this->terminal_hits
+        << " wait: " << this->wait_seconds << "s"
+        << " collisions: " << this->collisions
+        << " nodes: " << this->node_count
+        << " (" << this->node_bytes / 1024 << " KB)";
+    return out.str();
+}
+
+std::vector<double> MCTS::get_action_probs(GameField* g, double temp) {
+    return this->get_action_probs(g, temp, this->num_mcts_sims,
+        std::chrono::milliseconds(0));
+}
+
+std::vector<double> MCTS::get_action_probs(GameField* g, double temp,
+    unsigned int max_sims, std::chrono::milliseconds time_budget) {
+    this->search(g, max_sims, time_budget);
 
     // std::cout << "simulation ends" << std::endl;
 
+    return this->get_probs(temp);
+}
+
+void MCTS::search(GameField* g, unsigned int max_sims,
+    std::chrono::milliseconds time_budget) {
+    using clock = std::chrono::steady_clock;
+
+    this->reset_search_stats();
+    this->prune_tree();
+
+    // dirichlet noise only at the root, once per root
+    if (this->use_noise && !this->root_noise_added) {
+        this->add_root_noise(g);
+    }
+
+    if (this->coroutine_leaves > 0) {
+        this->search_coroutines(g, max_sims, time_budget);
+        this->search_end = clock::now();
+        return;
+    }
+
+    bool private_trees = this->root_parallel && this->thread_num > 1;
+    if (private_trees) {
+        this->sync_worker_roots(g);
+    }
+
+    auto start = clock::now();
+    std::atomic<unsigned int> sims_started(0);
+    std::atomic<unsigned int> sims_done(0);
+    std::atomic<unsigned int> next_tree(0);
+    std::atomic<bool> stop(false);
+
+    // each worker keeps simulating until the cap, the budget or early stop
+    auto worker = [&] {
+        TreeNode* tree = private_trees ?
+            this->worker_roots[next_tree++ % this->thread_num].get() :
+            this->root.get();
+
+        while (!stop.load() && !this->stop_search.load()) {
+            // reserve up to gather_size sims, never past the cap
+            unsigned int begin = sims_started.load();
+            unsigned int wanted = 0;
+            do {
+                if (begin >= max_sims) {
+                    break;
+                }
+                wanted = std::min(this->gather_size, max_sims - begin);
+            } while (!sims_started.compare_exchange_weak(begin, begin + wanted));
+            if (begin >= max_sims) {
+                break;
+            }
+
+            unsigned int visits = 1;
+            if (wanted > 1) {
+                visits = this->simulate_batch(g, wanted, tree);
+
+                // give back the slots lost to collisions
+                sims_started -= wanted - visits;
+
+                // some leaves are already in flight, let their owners finish
+                if (visits < wanted) {
+                    std::this_thread::yield();
+                }
+            }
+            else {
+                // copy gomoku
+                this->simulate(std::make_shared<GameField>(*g), -1, tree);
+            }
+            unsigned int done = (sims_done += visits);
+
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                clock::now() - start);
+            if (time_budget.count() > 0 && elapsed >= time_budget) {
+                stop.store(true);
+                break;
+            }
+
+            // root has no visits to compare until the trees are merged
+            if (!this->early_stop || private_trees) {
+                continue;
+            }
+
+            if (this->can_stop_early(
+                this->get_sims_left(done, max_sims, elapsed, time_budget))) {
+                stop.store(true);
+            }
+        }
+    };
+
+    this->run_workers(worker);
+    if (private_trees) {
+        this->merge_worker_roots();
+    }
+    this->search_end = clock::now();
+}
+
+void MCTS::search_coroutines(GameField* g, unsigned int max_sims,
+    std::chrono::milliseconds time_budget) {
+    using clock = std::chrono::steady_clock;
+
+    // coroutines descend the shared tree one leaf at a time
+    if (this->gather_size > 1 || this->root_parallel) {
+        throw std::runtime_error(
+            "coroutine search can't gather leaves or use private trees");
+    }
+
+    auto start = clock::now();
+    std::atomic<unsigned int> sims_started(0);
+    std::atomic<unsigned int> sims_done(0);
+    std::atomic<bool> stop(false);
+
+    auto worker = [&] {
+        while (true) {
+            std::coroutine_handle<> handle;
+            {
+                std::lock_guard<std::mutex> lock(this->ready_lock);
+                if (!this->ready.empty()) {
+                    handle = this->ready.front();
+                    this->ready.pop_front();
+                }
+            }
+
+            // finish evaluated leaves first, they free in-flight slots
+            if (handle) {
+                this->coroutines_in_flight--;
+                handle.resume();
+                continue;
+            }
+
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                clock::now() - start);
+            if (time_budget.count() > 0 && elapsed >= time_budget) {
+                stop.store(true);
+            }
+            else if (this->early_stop && this->can_stop_early(this->get_sims_left(
+                sims_done.load(), max_sims, elapsed, time_budget))) {
+                stop.store(true);
+            }
+
+            // start another simulation while under the in-flight cap
+            if (!stop.load() && !this->stop_search.load() &&
+                this->coroutines_in_flight.load() < this->coroutine_leaves) {
+                if (sims_started.fetch_add(1) < max_sims) {
+                    bool collided = false;
+                    this->simulate_coroutine(std::make_shared<GameField>(*g),
+                        collided, sims_done);
+                    if (!collided) {
+                        continue;
+                    }
+                }
+                sims_started--;
+            }
+
+            bool exhausted = stop.load() || this->stop_search.load() ||
+                sims_started.load() >= max_sims;
+            if (exhausted && this->coroutines_in_flight.load() == 0) {
+                break;
+            }
+
+            // wait for the network
+            std::unique_lock<std::mutex> lock(this->ready_lock);
+            this->ready_cv.wait_for(lock, std::chrono::milliseconds(1),
+                [this] { return !this->ready.empty(); });
+        }
+    };
+
+    // coroutine workers never block on the network
+    this->run_workers(worker, false);
+}
+
+SimTask MCTS::simulate_coroutine(std::shared_ptr<GameField> g, bool& collided,
+    std::atomic<unsigned int>& sims_done) {
+    auto node = this->select_leaf(this->root.get(), g.get());
+
+    auto status = g->referee();
+    if (status != unfinished) {
+        this->record_depth(node);
+        node->backup(-(status == g->current_color ? 1 : -1));
+        this->stat_terminal_hits++;
+        sims_done++;
+        co_return;
+    }
+
+    if (node->in_flight.exchange(true)) {
+        // already waiting for the network
+        node->revert_virtual_loss();
+        this->stat_collisions++;
+        collided = true;
+        co_return;
+    }
+
+    this->record_depth(node);
+
+    // collided is the caller's local, not valid after this point
+    EvalAwaiter eval{ this, g.get(), {}, nullptr };
+    co_await eval;
+    this->stat_nn_evals++;
+
+    if (this->can_expand(node)) {
+        *this->node_count += node->expand(this->get_priors(g.get(), eval.slot.probs));
+    }
+    node->in_flight.store(false);
+    node->backup(-eval.slot.value);
+    sims_done++;
+}
+
+void MCTS::resume_later(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(this->ready_lock);
+        this->ready.emplace_back(handle);
+    }
+    this->ready_cv.notify_one();
+}
+
+void EvalAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->mcts->coroutines_in_flight++;
+    this->handle = handle;
+
+    // the frame may be resumed as soon as the slot is filled, don't touch it after
+    this->slot.notify = &EvalAwaiter::on_ready;
+    this->slot.context = this;
+    this->mcts->neural_network->commit(this->game, &this->slot);
+}
+
+void EvalAwaiter::on_ready(void* context) {
+    auto eval = static_cast<EvalAwaiter*>(context);
+    eval->mcts->resume_later(eval->handle);
+}
+
+void MCTS::sync_worker_roots(GameField* g) {
+    // the shared root priors, noise included, seed every private tree
+    if (this->root->is_leaf) {
+        this->simulate(std::make_shared<GameField>(*g));
+    }
+
+    std::vector<double> priors(this->action_size, 0);
+    for (unsigned int i = 0; i < this->action_size; i++) {
+        if (this->root->children[i] != nullptr) {
+            priors[i] = this->root->children[i]->p_sa;
+        }
+    }
+
+    while (this->worker_roots.size() < this->thread_num) {
+        this->worker_roots.emplace_back(
+            new TreeNode(nullptr, 1., this->action_size), MCTS::tree_deleter);
+        (*this->node_count)++;
+    }
+
+    for (auto& tree : this->worker_roots) {
+        if (tree->is_leaf) {
+            *this->node_count += tree->expand(priors);
+            continue;
+        }
+
+        for (unsigned int i = 0; i < this->action_size; i++) {
+            if (tree->children[i] != nullptr) {
+                tree->children[i]->p_sa = priors[i];
+            }
+        }
+    }
+}
+
+void MCTS::merge_worker_roots() {
+    unsigned int sum_n = 0;
+
+    for (unsigned int i = 0; i < this->action_size; i++) {
+        auto child = this->root->children[i];
+        if (child == nullptr) {
+            continue;
+        }
+
+        // visit-weighted q over all trees
+        unsigned int n_visited = 0;
+        double sum_q = 0;
+        for (auto& tree : this->worker_roots) {
+            auto c = tree->children[i];
+            if (c != nullptr) {
+                n_visited += c->n_visited.load();
+                sum_q += c->n_visited.load() * c->q_sa;
+            }
+        }
+
+        child->n_visited.store(n_visited);
+        child->q_sa = n_visited > 0 ? sum_q / n_visited : 0;
+        sum_n += n_visited;
+    }
+
+    this->root->n_visited.store(sum_n + 1);
+
+    // the root value is the self-play target, weigh each tree by its visits
+    unsigned int root_n = 0;
+    double sum_root_q = 0;
+    for (auto& tree : this->worker_roots) {
+        root_n += tree->n_visited.load();
+        sum_root_q += tree->n_visited.load() * tree->q_sa;
+    }
+    if (root_n > 0) {
+        this->root->q_sa = sum_root_q / root_n;
+    }
+}
+
+void MCTS::run_workers(const std::function<void()>& worker, bool blocking) {
+    // workers waiting on their own commits let the batcher fire early
+    auto producer = [this, &worker, blocking] {
+        if (blocking) {
+            this->neural_network->register_producer();
+        }
+        worker();
+        if (blocking) {
+            this->neural_network->unregister_producer();
+        }
+    };
+
+    // no pool, search on the caller's thread
+    if (this->thread_num == 0) {
+        producer();
+        return;
+    }
+
+    // the pools are shared and owned by CpuScheduler, a network alone in
+    // the process gets a pool per node, its workers are split by pool size
+    auto pools = CpuScheduler::get_instance().get_search_pools(
+        this->neural_network->numa_node);
+    size_t pool_threads = 0;
+    for (auto pool : pools) {
+        pool_threads += pool->get_thread_num();
+    }
+
+    std::vector<std::future<void>> others;
+    unsigned int given = 0;
+    for (size_t i = 1; i < pools.size(); i++) {
+        unsigned int share = this->thread_num * pools[i]->get_thread_num() / pool_threads;
+        if (share == 0) {
+            continue;
+        }
+
+        auto pool = pools[i];
+        others.emplace_back(pool->commit([pool, share, &producer] {
+            pool->parallel_for(share, [&producer] (size_t) { producer(); });
+        }));
+        given += share;
+    }
+
+    // one long-running worker per thread, the caller runs one of them
+    std::exception_ptr error;
+    try {
+        pools[0]->parallel_for(this->thread_num - given,
+            [&producer] (size_t) { producer(); });
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    // the other shares use producer, wait for them even on error
+    for (auto& other : others) {
+        other.wait();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    for (auto& other : others) {
+        other.get();
+    }
+}
+
+std::pair<int, std::vector<double>> MCTS::get_gumbel_action_probs(GameField* g,
+    unsigned int num_sims, unsigned int max_considered) {
+    this->reset_search_stats();
+    this->prune_tree();
+
+    // the root priors are needed before anything can be sampled
+    if (this->root->is_leaf) {
+        this->simulate(std::make_shared<GameField>(*g));
+    }
+
+    const auto& children = this->root->children;
+    std::vector<int> actions;
+    std::vector<double> logits(ALL, -DBL_MAX);
+    std::vector<double> gumbel(ALL, 0);
+
+    auto& rng = get_thread_rng();
+
+    for (int i = 0; i < ALL; i++) {
+        if (children[i] == nullptr) {
+            continue;
+        }
+        actions.emplace_back(i);
+        logits[i] = log(std::max(children[i]->p_sa, DBL_MIN));
+        gumbel[i] = -log(-log(std::max(rng.next_double(), DBL_MIN)));
+    }
+
+    // gumbel top-k
+    unsigned int considered_num = std::min<unsigned int>(
+        std::min(max_considered, num_sims), actions.size());
+    considered_num = std::max(considered_num, 1u);
+
+    auto score = [&](int a) {
+        return gumbel[a] + logits[a] + this->sigma_q(this->get_completed_q(a));
+    };
+
+    std::sort(actions.begin(), actions.end(),
+        [&](int a, int b) { return gumbel[a] + logits[a] > gumbel[b] + logits[b]; });
+    std::vector<int> considered(actions.begin(), actions.begin() + considered_num);
+
+    // sequential halving over the considered actions
+    unsigned int phases = std::max(1, int(ceil(log2(considered_num))));
+    unsigned int sims_left = num_sims;
+
+    for (unsigned int phase = 0; phase < phases; phase++) {
+        unsigned int sims_per_action = std::max<unsigned int>(1,
+            sims_left / ((phases - phase) * considered.size()));
+
+        std::vector<int> forced;
+        for (auto a : considered) {
+            forced.insert(forced.end(), sims_per_action, a);
+        }
+        this->simulate_forced(g, forced);
+        sims_left -= std::min<unsigned int>(sims_left, forced.size());
+
+        std::sort(considered.begin(), considered.end(),
+            [&](int a, int b) { return score(a) > score(b); });
+        if (phase + 1 < phases) {
+            considered.resize((considered.size() + 1) / 2);
+        }
+    }
+
+    int action = considered[0];
+
+    // improved policy, softmax(logits + sigma(completed q))
+    std::vector<double> improved_probs(ALL, 0);
+    double max_logit = -DBL_MAX;
+    for (int i = 0; i < ALL; i++) {
+        if (children[i] == nullptr) {
+            continue;
+        }
+        improved_probs[i] = logits[i] + this->sigma_q(this->get_completed_q(i));
+        max_logit = std::max(max_logit, improved_probs[i]);
+    }
+
+    double sum = 0;
+    for (int i = 0; i < ALL; i++) {
+        if (children[i] == nullptr) {
+            continue;
+        }
+        improved_probs[i] = exp(improved_probs[i] - max_logit);
+        sum += improved_probs[i];
+    }
+
+    // renormalization
+    std::for_each(improved_probs.begin(), improved_probs.end(),
+        [sum] (double& x) { x /= sum; });
+
+    this->search_end = std::chrono::steady_clock::now();
+    return { action, improved_probs };
+}
+
+void MCTS::simulate_forced(GameField* g, const std::vector<int>& forced) {
+    std::atomic<unsigned int> next(0);
+
+    this->run_workers([&] {
+        unsigned int i;
+        while ((i = next++) < forced.size()) {
+            this->simulate(std::make_shared<GameField>(*g), forced[i]);
+        }
+    });
+}
+
+double MCTS::get_completed_q(int action) const {
+    const auto& children = this->root->children;
+    auto child = children[action];
+    if (child != nullptr && child->n_visited.load() > 0) {
+        return child->q_sa;
+    }
+
+    // mixed value, the root value and the prior-weighted q of visited children
+    double sum_p = 0;
+    double sum_pq = 0;
+    unsigned int sum_n = 0;
+    for (auto c : children) {
+        if (c != nullptr && c->n_visited.load() > 0) {
+            sum_p += c->p_sa;
+            sum_pq += c->p_sa * c->q_sa;
+            sum_n += c->n_visited.load();
+        }
+    }
+
+    double root_value = -this->root->q_sa;
+    if (sum_n == 0 || sum_p <= 0) {
+        return root_value;
+    }
+    return (root_value + sum_n * sum_pq / sum_p) / (1 + sum_n);
+}
+
+double MCTS::sigma_q(double q) const {
+    unsigned int max_n = 0;
+    for (auto c : this->root->children) {
+        if (c != nullptr) {
+            max_n = std::max(max_n, c->n_visited.load());
+        }
+    }
+
+    // q from [-1, 1] to [0, 1]
+    return (GUMBEL_C_VISIT + max_n) * GUMBEL_C_SCALE * (q + 1) / 2;
+}
+
+void MCTS::start_ponder(GameField* g) {
+    this->stop_ponder();
+
+    // the caller's game field changes while pondering
+    auto game = std::make_shared<GameField>(*g);
+    this->ponder_thread = std::make_unique<std::thread>([this, game] {
+        this->search(game.get(), UINT_MAX, std::chrono::milliseconds(0));
+    });
+}
+
+void MCTS::stop_ponder() {
+    if (this->ponder_thread == nullptr) {
+        return;
+    }
+
+    this->stop_search.store(true);
+    this->ponder_thread->join();
+    this->ponder_thread.reset();
+    this->stop_search.store(false);
+}
+
+bool MCTS::can_stop_early(unsigned int sims_left) const {
+    unsigned int best = 0;
+    unsigned int second = 0;
+
+    for (auto child : this->root->children) {
+        if (child == nullptr) {
+            continue;
+        }
+
+        unsigned int n_visited = child->n_visited.load();
+        if (n_visited > best) {
+            second = best;
+            best = n_visited;
+        }
+        else if (n_visited > second) {
+            second = n_visited;
+        }
+    }
+
+    // the runner-up can't catch up even if it gets every remaining visit
+    return best > 0 && best - second > sims_left;
+}
+
+unsigned int MCTS::get_sims_left(unsigned int done, unsigned int max_sims,
+    std::chrono::milliseconds elapsed, std::chrono::milliseconds time_budget) const {
+    // upper bound of the visits the rest of the search can still add
+    unsigned int sims_left = done < max_sims ? max_sims - done : 0;
+    if (time_budget.count() > 0 && elapsed.count() > 0) {
+        double rate = double(done) / elapsed.count();
+        double sims_in_time = rate * (time_budget - elapsed).count();
+        if (sims_in_time < sims_left) {
+            sims_left = static_cast<unsigned int>(sims_in_time) + 1;
+        }
+    }
+    return sims_left;
+}
+
+std::vector<double> MCTS::get_probs(double temp) const {
     // calculate probs
     std::vector<double> action_probs(ALL, 0);
     const auto& children = this->root->children;
@@ -246,10 +1174,17 @@ std::vector<double> MCTS::get_action_probs(GameField* g, double temp) {
     }
 }
 
-void MCTS::simulate(std::shared_ptr<GameField> g, bool explore)
+TreeNode* MCTS::select_leaf(TreeNode* node, GameField* g, int forced_action)
 {
-    auto node = this->root.get();
+    // the first move is given, e.g. by the gumbel root search
+    if (forced_action >= 0 && !node->is_leaf && node->children[forced_action] != nullptr)
+    {
+        node = node->children[forced_action];
+        node->virtual_loss++;
+        g->play(forced_action);
+    }
 
+    // descend with virtual loss until a leaf is reached
     while (true)
     {
         if (node->is_leaf) break;
@@ -257,75 +1192,174 @@ void MCTS::simulate(std::shared_ptr<GameField> g, bool explore)
         g->play(action);
         node = node->children[action];
     }
+    return node;
+}
+
+std::vector<double> MCTS::get_priors(GameField* g, const float* net_pri_probs)
+{
+    std::vector<double> pri_probs(net_pri_probs, net_pri_probs + this->action_size);
+    auto legal_moves_mask = g->valid_moves_mask(g->current_color);
+    double sum = 0;
+
+    for (int i = 0; i < legal_moves_mask.size(); i++)
+    {
+        if (legal_moves_mask[i] == 1)
+        {
+            sum += net_pri_probs[i];
+        }
+        else pri_probs[i] = 0;
+    }
+
+    std::for_each(pri_probs.begin(), pri_probs.end(), [sum] (double& x) { x /= sum; });
+
+    return pri_probs;
+}
+
+void MCTS::add_root_noise(GameField* g)
+{
+    // the root priors are needed before they can be mixed
+    if (this->root->is_leaf)
+    {
+        this->simulate(std::make_shared<GameField>(*g));
+    }
+
+    auto& children = this->root->children;
+    int valid_cnt = std::count_if(children.begin(), children.end(),
+        [] (TreeNode* child) { return child != nullptr; });
+    auto noise_prob = get_noise(valid_cnt);
+
+    // snapshots keep the network priors
+    this->root_priors.assign(children.size(), 0);
+
+    int noise_ptr = 0;
+    for (unsigned int i = 0; i < children.size(); i++)
+    {
+        if (children[i] != nullptr)
+        {
+            this->root_priors[i] = children[i]->p_sa;
+            children[i]->p_sa = 0.8 * children[i]->p_sa + 0.2 * noise_prob[noise_ptr++];
+        }
+    }
+
+    this->root_noise_added = true;
+}
+
+void MCTS::simulate(std::shared_ptr<GameField> g, int forced_action, TreeNode* tree)
+{
+    if (tree == nullptr)
+    {
+        tree = this->root.get();
+    }
+    auto node = this->select_leaf(tree, g.get(), forced_action);
+
+    this->record_depth(node);
 
     auto status = g->referee();
     double value = 0;
 
     if (status == unfinished)
     {
-        //std::pair<std::vector<float>, float> net_output;
-        //try 
-        //{
-        //    auto net_ouput = neural_network->get_net_output(g);
-        //}
-        //catch (std::runtime_error& e)
-        //{
-        //    std::cout << e.what() << std::endl;
-        //    exit(1);
-        //}
-        auto future = this->neural_network->commit(g.get());
-        auto result = future.get();
-        auto net_pri_probs = std::move(result[0]);
-
-        value = result[1][0];
-        //std::cout << "--------" << std::endl;
-        //for (auto i : net_pri_probs)
-        //{
-        //    std::cout << i << std::endl;
-        //}
-        //std::cout << "--------" << std::endl;
-
-        auto pri_probs = net_pri_probs;
-        auto legal_moves_mask = g->valid_moves_mask(g->current_color);
-        double sum = 0;
+        EvalSlot slot;
+        auto wait_begin = std::chrono::steady_clock::now();
+        this->neural_network->commit(g.get(), &slot);
+        EvalWaker::current()->wait(1);
+        this->stat_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - wait_begin).count();
+        this->stat_nn_evals++;
 
-        for (int i = 0; i < legal_moves_mask.size(); i++)
+        value = slot.value;
+        if (this->can_expand(node))
         {
-            if (legal_moves_mask[i] == 1)
-            {
-                sum += net_pri_probs[i];
-            }
-            else pri_probs[i] = 0;
+            *this->node_count += node->expand(this->get_priors(g.get(), slot.probs));
         }
+    }
+    else
+    {
+        this->stat_terminal_hits++;
+        auto winner = status;
+        value = (winner == g->current_color ? 1 : -1);
+    }
+    node->backup(-value);
+}
+
+unsigned int MCTS::simulate_batch(GameField* g, unsigned int max_leaves, TreeNode* tree)
+{
+    if (tree == nullptr)
+    {
+        tree = this->root.get();
+    }
+
+    std::vector<TreeNode*> leaves;
+    std::vector<std::shared_ptr<GameField>> games;
+    std::vector<GameField*> inputs;
 
-        std::for_each(pri_probs.begin(), pri_probs.end(), [sum] (double& x) { x /= sum; });
+    unsigned int visits = 0;
+    unsigned int collisions = 0;
+
+    // gather distinct leaves, the virtual loss of each descent steers the next
+    while (leaves.size() + visits < max_leaves && collisions < max_leaves)
+    {
+        auto game = std::make_shared<GameField>(*g);
+        auto node = this->select_leaf(tree, game.get());
 
-        auto long_noise_prob = std::vector<double>(ALL, 0);
-        if (explore)
+        auto status = game->referee();
+        if (status != unfinished)
         {
-            int valid_cnt = std::accumulate(legal_moves_mask.begin(), legal_moves_mask.end(), 0);
-            auto noise_prob = get_noise(valid_cnt);
+            // terminal, back up at once
+            this->record_depth(node);
+            node->backup(-(status == game->current_color ? 1 : -1));
+            this->stat_terminal_hits++;
+            visits++;
+            continue;
+        }
 
-            int noise_ptr = 0;
-            for (int i = 0; i < ALL; i++)
-            {
-                if (legal_moves_mask[i] == 1)
-                {
-                    long_noise_prob[i] = noise_prob[noise_ptr++];
-                }
-            }
-            for (int i = 0; i < ALL; i++)
-            {
-                pri_probs[i] = 0.8 * pri_probs[i] + 0.2 * long_noise_prob[i];
-            }
+        if (node->in_flight.exchange(true))
+        {
+            // already waiting for the network
+            node->revert_virtual_loss();
+            this->stat_collisions++;
+            collisions++;
+            continue;
         }
 
-        node->expand(pri_probs);
+        this->record_depth(node);
+        leaves.emplace_back(node);
+        inputs.emplace_back(game.get());
+        games.emplace_back(std::move(game));
     }
-    else
+
+    if (leaves.empty())
     {
-        auto winner = status;
-        value = (winner == g->current_color ? 1 : -1);
+        return visits;
     }
-    node->backup(-value);
+
+    // one submission for the whole batch, the slots are reused by this thread
+    thread_local std::unique_ptr<EvalSlot[]> slots;
+    thread_local size_t slot_num = 0;
+    if (slot_num < leaves.size())
+    {
+        slot_num = std::max<size_t>(leaves.size(), this->gather_size);
+        slots.reset(new EvalSlot[slot_num]);
+    }
+
+    auto wait_begin = std::chrono::steady_clock::now();
+    this->neural_network->commit(inputs, slots.get());
+    EvalWaker::current()->wait(leaves.size());
+    this->stat_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - wait_begin).count();
+    this->stat_nn_evals += leaves.size();
+
+    for (unsigned int i = 0; i < leaves.size(); i++)
+    {
+        double value = slots[i].value;
+
+        if (this->can_expand(leaves[i]))
+        {
+            *this->node_count += leaves[i]->expand(this->get_priors(inputs[i], slots[i].probs));
+        }
+        leaves[i]->in_flight.store(false);
+        leaves[i]->backup(-value);
+    }
+
+    return visits + leaves.size();
 }
\ No newline at end of file
@@ -5,11 +5,25 @@
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <coroutine>
+#include <deque>
 
 #include "GameField.h"
 #include "thread_pool.h"
+#include "cpu_scheduler.h"
 #include "libtorch.h"
 
+const double GUMBEL_C_VISIT = 50;
+const double GUMBEL_C_SCALE = 1.0;
+
+// tree memory cap, prune to PRUNE_TARGET of the limit once PRUNE_TRIGGER is hit
+const double PRUNE_TRIGGER = 0.75;
+const double PRUNE_TARGET = 0.5;
+
 class TreeNode {
 public:
     // friend class can access private variables
@@ -22,8 +36,9 @@ public:
     TreeNode& operator=(const TreeNode& p);
 
     unsigned int select(double c_puct, double c_virtual_loss);
-    void expand(const std::vector<double>& action_priors);
+    unsigned int expand(const std::vector<double>& action_priors);  // returns children created
     void backup(double leaf_value);
+    void revert_virtual_loss();
 
     double get_value(double c_puct, double c_virtual_loss,
         unsigned int sum_n_visited) const;
@@ -39,6 +54,73 @@ public:
     double p_sa;
     double q_sa;
     std::atomic<int> virtual_loss;
+    std::atomic<bool> in_flight;  // waiting for the network
+};
+
+// delete detached subtrees off the search thread
+class TreeReclaimer {
+public:
+    TreeReclaimer();
+    ~TreeReclaimer();
+
+    // hand over a subtree, returns at once, node_count is decreased once deleted
+    void reclaim(TreeNode* tree,
+        std::shared_ptr<std::atomic<long long>> node_count = nullptr);
+    static TreeReclaimer& get_instance();  // process-wide reclaimer
+
+private:
+    using tree_type = std::pair<TreeNode*, std::shared_ptr<std::atomic<long long>>>;
+
+    std::unique_ptr<std::thread> worker;
+    std::vector<tree_type> trees;  // subtrees waiting for deletion
+    std::mutex lock;
+    std::condition_variable cv;
+    bool running;
+};
+
+// statistics of the last search
+struct SearchStats {
+    unsigned int simulations;
+    double seconds;
+    double sims_per_second;
+    double mean_depth;
+    unsigned int max_depth;
+    unsigned int nn_evals;
+    unsigned int terminal_hits;
+    double wait_seconds;  // waiting on network results, summed over threads
+    unsigned int collisions;
+    long long node_count;
+    long long node_bytes;
+
+    std::string to_string() const;
+};
+
+class MCTS;
+
+// fire-and-forget simulation, runs until it waits on the network and is
+// resumed by a search thread once the result is back
+struct SimTask {
+    struct promise_type {
+        SimTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// co_await a network evaluation without blocking the thread, the result
+// is in slot once resumed
+struct EvalAwaiter {
+    MCTS* mcts;
+    GameField* game;
+    EvalSlot slot;
+    std::coroutine_handle<> handle;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const noexcept {}
+    static void on_ready(void* context);  // from the infer thread
 };
 
 class MCTS {
@@ -46,19 +128,118 @@ public:
     MCTS(NeuralNetwork* neural_network, unsigned int thread_num, double c_puct,
         unsigned int num_mcts_sims, double c_virtual_loss,
         unsigned int action_size);
+    ~MCTS();
     std::vector<double> get_action_probs(GameField* g, double temp = 1e-3);
+    // search with a simulation cap and a wall-clock budget (0 = unlimited)
+    std::vector<double> get_action_probs(GameField* g, double temp,
+        unsigned int max_sims, std::chrono::milliseconds time_budget);
     void update_with_move(int last_move);
+    TreeNode* advance_root(TreeNode* old_root, int last_action);
+
+    void search(GameField* g, unsigned int max_sims,
+        std::chrono::milliseconds time_budget);
+    bool can_stop_early(unsigned int sims_left) const;
+    // upper bound of the sims left, from the cap and the rate so far
+    unsigned int get_sims_left(unsigned int done, unsigned int max_sims,
+        std::chrono::milliseconds elapsed, std::chrono::milliseconds time_budget) const;
+    std::vector<double> get_probs(double temp) const;
+    void run_workers(const std::function<void()>& worker, bool blocking = true);
+
+    // root parallel, every worker searches a private tree and the root
+    // children of all trees are merged into root when the search ends
+    void sync_worker_roots(GameField* g);
+    void merge_worker_roots();
+
+    // gumbel top-k with sequential halving at the root, returns the selected
+    // action and the improved policy as training target
+    std::pair<int, std::vector<double>> get_gumbel_action_probs(GameField* g,
+        unsigned int num_sims, unsigned int max_considered = 16);
+    void simulate_forced(GameField* g, const std::vector<int>& forced);
+    double get_completed_q(int action) const;
+    double sigma_q(double q) const;
+
+    // keep searching from the current root in background until stop_ponder
+    void start_ponder(GameField* g);
+    void stop_ponder();
 
-    void simulate(std::shared_ptr<GameField> game, bool explore);
+    // coroutine search, up to coroutine_leaves simulations wait on the
+    // network at once while the threads only select, expand and back up
+    // on the shared tree, gather_size > 1 and root_parallel are rejected
+    void search_coroutines(GameField* g, unsigned int max_sims,
+        std::chrono::milliseconds time_budget);
+    SimTask simulate_coroutine(std::shared_ptr<GameField> game, bool& collided,
+        std::atomic<unsigned int>& sims_done);
+    void resume_later(std::coroutine_handle<> handle);  // from the infer thread
+
+    // tree defaults to root
+    void simulate(std::shared_ptr<GameField> game, int forced_action = -1,
+        TreeNode* tree = nullptr);
+    // descend up to max_leaves times and evaluate the leaves in one batch
+    unsigned int simulate_batch(GameField* g, unsigned int max_leaves,
+        TreeNode* tree = nullptr);
+    TreeNode* select_leaf(TreeNode* node, GameField* g, int forced_action = -1);
+    std::vector<double> get_priors(GameField* g, const float* net_pri_probs);
+    void add_root_noise(GameField* g);
     static void tree_deleter(TreeNode* t);
+    static long long delete_tree(TreeNode* t);  // returns nodes deleted
+
+    // cap the tree, 0 = unlimited; when full, leaves are evaluated but not expanded
+    void set_memory_limit(long long bytes);
+    long long get_node_bytes() const;
+    bool tree_full() const;
+    bool can_expand(const TreeNode* node) const;
+    void prune_tree();
+    long long prune_children(TreeNode* node, unsigned int threshold);
+    static long long count_nodes(TreeNode* t);
+
+    // binary snapshot of the tree and its root position, the root priors
+    // are saved without the dirichlet noise
+    void save_tree(const std::string& path, GameField* g) const;
+    GameField load_tree(const std::string& path);
+    static void save_node(std::ostream& out, TreeNode* node, double p_sa,
+        const std::vector<double>* child_priors = nullptr);
+    TreeNode* load_node(std::istream& in, TreeNode* parent);
+
+    SearchStats get_search_stats() const;
+    void reset_search_stats();
+    void record_depth(TreeNode* leaf);
 
     // variables
     std::unique_ptr<TreeNode, decltype(MCTS::tree_deleter)*> root;
-    std::unique_ptr<ThreadPool> thread_pool;
+    std::vector<std::unique_ptr<TreeNode, decltype(MCTS::tree_deleter)*>> worker_roots;
     NeuralNetwork* neural_network;
 
+    std::unique_ptr<std::thread> ponder_thread;
+    std::atomic<bool> stop_search;  // interrupt a running search
+
+    // suspended simulations whose evaluation is done
+    std::deque<std::coroutine_handle<>> ready;
+    std::mutex ready_lock;
+    std::condition_variable ready_cv;
+    std::atomic<unsigned int> coroutines_in_flight;
+
+    unsigned int thread_num;  // 0: search on the calling thread
     unsigned int action_size;
     unsigned int num_mcts_sims;
+    unsigned int gather_size;  // leaves gathered per descent batch
+    bool early_stop;  // stop once the best root child can't be overtaken, keep off for training targets
+    bool root_parallel;  // private tree per worker instead of one shared tree
+    unsigned int coroutine_leaves;  // in-flight coroutine simulations, 0: off
+    bool use_noise;   // dirichlet noise at the root
+    bool root_noise_added;
+    std::vector<double> root_priors;  // root child priors before the noise
     double c_puct;
     double c_virtual_loss;
+
+    // search counters
+    std::shared_ptr<std::atomic<long long>> node_count;  // nodes in the tree
+    long long node_limit;
+    std::chrono::steady_clock::time_point search_begin;
+    std::chrono::steady_clock::time_point search_end;
+    std::atomic<unsigned int> stat_nn_evals;
+    std::atomic<unsigned int> stat_terminal_hits;
+    std::atomic<unsigned int> stat_collisions;
+    std::atomic<unsigned long long> stat_depth_sum;
+    std::atomic<unsigned int> stat_max_depth;
+    std::atomic<long long> stat_wait_ns;
 };
@@ -0,0 +1,245 @@
+#include "cpu_scheduler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+CpuScheduler::CpuScheduler()
+    : core_budget(std::max(1u, std::thread::hardware_concurrency())),
+    torch_threads(1),
+    pin_cores(false),
+    nodes(read_numa_nodes()),
+    next_node(0),
+    network_num(0) {}
+
+CpuScheduler& CpuScheduler::get_instance() {
+    static CpuScheduler scheduler;
+    return scheduler;
+}
+
+void CpuScheduler::configure(unsigned int core_budget, unsigned int torch_threads,
+    const std::vector<unsigned int>& cpus, bool pin_cores) {
+    std::lock_guard<std::mutex> lock(this->lock);
+
+    // the pool threads already run with the old budget
+    if (!this->search_pools.empty()) {
+        throw std::runtime_error("configure CpuScheduler before the first search");
+    }
+
+    // keep the allowed cpus of every node, drop empty nodes
+    this->nodes.clear();
+    for (auto& node : read_numa_nodes()) {
+        std::vector<unsigned int> allowed;
+        for (auto cpu : node) {
+            if (cpus.empty() || std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+                allowed.emplace_back(cpu);
+            }
+        }
+        if (!allowed.empty()) {
+            this->nodes.emplace_back(std::move(allowed));
+        }
+    }
+    if (this->nodes.empty()) {
+        this->nodes.emplace_back(cpus);
+    }
+
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    if (!cpus.empty()) {
+        cores = std::min<unsigned int>(cores, cpus.size());
+    }
+
+    this->core_budget = core_budget == 0 ? cores : std::min(core_budget, cores);
+    this->torch_threads = std::max(1u, std::min(torch_threads, this->core_budget));
+    this->pin_cores = pin_cores;
+    this->cpus = cpus;
+}
+
+ThreadPool* CpuScheduler::get_search_pool(unsigned int node) {
+    std::lock_guard<std::mutex> lock(this->lock);
+
+    if (this->search_pools.empty()) {
+        // split the search threads by the cpus of every node
+        unsigned int cpu_tot = 0;
+        for (auto& cpus : this->nodes) {
+            cpu_tot += cpus.size();
+        }
+
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            unsigned int thread_num = std::max<unsigned int>(1,
+                cpu_tot > 0 ? this->get_search_threads() * this->nodes[i].size() / cpu_tot :
+                this->get_search_threads() / this->nodes.size());
+
+            this->search_pools.emplace_back(std::make_unique<ThreadPool>(thread_num,
+                [this, i] (unsigned int index) {
+                    const auto& cpus = this->nodes[i];
+                    if (this->pin_cores && !cpus.empty()) {
+                        set_thread_affinity({ cpus[index % cpus.size()] });
+                    }
+                    else {
+                        this->pin_current_thread(i);
+                    }
+                }));
+        }
+    }
+    return this->search_pools[node % this->search_pools.size()].get();
+}
+
+std::vector<ThreadPool*> CpuScheduler::get_search_pools(unsigned int node) {
+    std::vector<ThreadPool*> pools{ this->get_search_pool(node) };
+    if (this->network_num.load() > 1) {
+        return pools;
+    }
+
+    // nothing to keep apart, a single network uses the whole machine
+    for (auto& pool : this->search_pools) {
+        if (pool.get() != pools[0]) {
+            pools.emplace_back(pool.get());
+        }
+    }
+    return pools;
+}
+
+unsigned int CpuScheduler::get_search_node(unsigned int node, unsigned int index) const {
+    if (this->network_num.load() > 1) {
+        return node;
+    }
+    return (node + index) % this->nodes.size();
+}
+
+unsigned int CpuScheduler::get_core_budget() const {
+    return this->core_budget;
+}
+
+unsigned int CpuScheduler::get_torch_threads() const {
+    return this->torch_threads;
+}
+
+unsigned int CpuScheduler::get_network_torch_threads() const {
+    return std::max(1u, this->torch_threads / std::max(1u, this->network_num.load()));
+}
+
+unsigned int CpuScheduler::get_search_threads() const {
+    // at least one, the searching threads help their own batches anyway
+    return std::max(1u, this->core_budget - this->torch_threads);
+}
+
+const std::vector<std::vector<unsigned int>>& CpuScheduler::get_nodes() const {
+    return this->nodes;
+}
+
+unsigned int CpuScheduler::assign_node() {
+    this->network_num++;
+    return this->next_node++ % this->nodes.size();
+}
+
+void CpuScheduler::release_node() {
+    this->network_num--;
+}
+
+void CpuScheduler::pin_current_thread() const {
+    if (!this->cpus.empty()) {
+        set_thread_affinity(this->cpus);
+    }
+}
+
+void CpuScheduler::pin_current_thread(unsigned int node) const {
+    // a single node is the whole machine, same as no node
+    if (this->nodes.size() <= 1) {
+        this->pin_current_thread();
+        return;
+    }
+    set_thread_affinity(this->nodes[node % this->nodes.size()]);
+}
+
+bool CpuScheduler::set_thread_affinity(const std::vector<unsigned int>& cpus) {
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    for (auto cpu : cpus) {
+        if (cpu < sizeof(DWORD_PTR) * 8) {
+            mask |= DWORD_PTR(1) << cpu;
+        }
+    }
+    return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+std::vector<std::vector<unsigned int>> CpuScheduler::read_numa_nodes() {
+    std::vector<std::vector<unsigned int>> nodes;
+
+#ifdef _WIN32
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest)) {
+        for (ULONG node = 0; node <= highest; node++) {
+            ULONGLONG mask = 0;
+            if (!GetNumaNodeProcessorMask(UCHAR(node), &mask) || mask == 0) {
+                continue;
+            }
+
+            std::vector<unsigned int> cpus;
+            for (unsigned int cpu = 0; cpu < 64; cpu++) {
+                if (mask & (ULONGLONG(1) << cpu)) {
+                    cpus.emplace_back(cpu);
+                }
+            }
+            nodes.emplace_back(std::move(cpus));
+        }
+    }
+#else
+    // cpulist looks like "0-7,16-23"
+    for (unsigned int node = 0; ; node++) {
+        std::ifstream fin("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!fin) {
+            break;
+        }
+
+        std::vector<unsigned int> cpus;
+        std::string range;
+        while (std::getline(fin, range, ',')) {
+            unsigned int first = 0;
+            unsigned int last = 0;
+            char dash = 0;
+            std::istringstream in(range);
+            if (!(in >> first)) {
+                continue;
+            }
+            last = (in >> dash >> last) ? last : first;
+            for (unsigned int cpu = first; cpu <= last; cpu++) {
+                cpus.emplace_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            nodes.emplace_back(std::move(cpus));
+        }
+    }
+#endif
+
+    // unknown topology, one node for everything
+    if (nodes.empty()) {
+        std::vector<unsigned int> cpus;
+        for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+            cpus.emplace_back(cpu);
+        }
+        nodes.emplace_back(std::move(cpus));
+    }
+    return nodes;
+}
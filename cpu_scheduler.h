@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include "thread_pool.h"
+
+// process-wide cpu budget, every MCTS searches on one shared pool and
+// libtorch gets the rest, so threads don't multiply with games and nets
+//
+// the pool is split per numa node, a network is placed on a node and the
+// searches feeding it use that node's pool, so the batcher, its producers
+// and the trees they grow (first touch) stay on one socket; a network alone
+// in the process searches on every node instead
+class CpuScheduler {
+public:
+    static CpuScheduler& get_instance();
+
+    // core_budget: cores the process may use, 0 = all
+    // torch_threads: libtorch intra-op threads taken from the budget
+    // cpus: cpus to run on, empty = all
+    // pin_cores: pin every search thread to one core, else to its node
+    void configure(unsigned int core_budget, unsigned int torch_threads,
+        const std::vector<unsigned int>& cpus = {}, bool pin_cores = false);
+
+    ThreadPool* get_search_pool(unsigned int node = 0);  // created on first use
+    // pools the searches of a network on node run on, node's pool first
+    std::vector<ThreadPool*> get_search_pools(unsigned int node);
+    // node of the index-th search thread of a network on node
+    unsigned int get_search_node(unsigned int node, unsigned int index) const;
+    unsigned int get_core_budget() const;
+    unsigned int get_torch_threads() const;
+    // share of one network, the torch threads are split between the live ones
+    unsigned int get_network_torch_threads() const;
+    unsigned int get_search_threads() const;
+
+    // allowed cpus of every numa node, one node when the topology is unknown
+    const std::vector<std::vector<unsigned int>>& get_nodes() const;
+    unsigned int assign_node();  // round-robin node for a new network
+    void release_node();  // a network is gone
+
+    // pin the calling thread to the allowed cpus, of one node if given
+    void pin_current_thread() const;
+    void pin_current_thread(unsigned int node) const;
+    static bool set_thread_affinity(const std::vector<unsigned int>& cpus);
+    static std::vector<std::vector<unsigned int>> read_numa_nodes();
+
+private:
+    CpuScheduler();
+
+    std::vector<std::unique_ptr<ThreadPool>> search_pools;  // per node
+    std::mutex lock;
+
+    unsigned int core_budget;
+    unsigned int torch_threads;
+    bool pin_cores;
+    std::vector<unsigned int> cpus;
+    std::vector<std::vector<unsigned int>> nodes;
+    std::atomic<unsigned int> next_node;
+    std::atomic<unsigned int> network_num;  // networks holding a node
+};
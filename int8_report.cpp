@@ -0,0 +1,157 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
+
+#include "GameField.h"
+#include "native_net.h"
+
+using namespace std;
+using namespace chrono;
+
+// calibrate the int8 trunk of a native net on recorded self-play positions
+// and compare it with float on games it has not seen
+//
+// usage: int8_report <model.native> [games directory] [calibration positions]
+// writes <model>.calib, which NeuralNetwork::load_calibration reads
+
+const size_t STATE_SIZE = 3 * WIDTH * WIDTH;
+const size_t HELD_OUT_MAX = 16384;
+const unsigned int REPORT_BATCH = 64;
+
+// in.txt holds one encoded position per line
+vector<float> read_positions(const filesystem::path& path)
+{
+	vector<float> states;
+	ifstream fin(path);
+	string line;
+	while (getline(fin, line))
+	{
+		istringstream in(line);
+		vector<float> state;
+		float x;
+		while (in >> x)
+		{
+			state.emplace_back(x);
+		}
+		if (state.size() == STATE_SIZE)
+		{
+			states.insert(states.end(), state.begin(), state.end());
+		}
+	}
+	return states;
+}
+
+double forward_us(const NativeNet& net, const vector<float>& states, vector<float>& probs, vector<float>& values)
+{
+	size_t count = states.size() / STATE_SIZE;
+	probs.resize(count * ALL);
+	values.resize(count);
+
+	auto start = steady_clock::now();
+	for (size_t i = 0; i < count; i += REPORT_BATCH)
+	{
+		unsigned int batch = unsigned(min<size_t>(REPORT_BATCH, count - i));
+		net.forward(&states[i * STATE_SIZE], batch, &probs[i * ALL], &values[i]);
+	}
+	return duration<double, micro>(steady_clock::now() - start).count() / max<size_t>(1, count);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		cout << "usage: int8_report <model.native> [games directory] [calibration positions]" << endl;
+		return 1;
+	}
+	string model_path = argv[1];
+	string games_path = argc > 2 ? argv[2] : "./games";
+	size_t calibration_num = argc > 3 ? stoul(argv[3]) : 2048;
+
+	try {
+		// whole games go to one side, neighbouring positions are alike
+		vector<filesystem::path> games;
+		for (auto& entry : filesystem::directory_iterator(games_path))
+		{
+			if (entry.is_directory() && filesystem::exists(entry.path() / "in.txt"))
+			{
+				games.emplace_back(entry.path());
+			}
+		}
+		sort(games.begin(), games.end());
+
+		vector<float> calibration, held_out;
+		for (auto& game : games)
+		{
+			auto states = read_positions(game / "in.txt");
+			if (calibration.size() < calibration_num * STATE_SIZE)
+			{
+				calibration.insert(calibration.end(), states.begin(), states.end());
+			}
+			else if (held_out.size() < HELD_OUT_MAX * STATE_SIZE)
+			{
+				held_out.insert(held_out.end(), states.begin(), states.end());
+			}
+		}
+		held_out.resize(min(held_out.size(), HELD_OUT_MAX * STATE_SIZE));
+		if (calibration.empty() || held_out.empty())
+		{
+			cout << "not enough positions in " << games_path << endl;
+			return 1;
+		}
+
+		NativeNet net(model_path);
+		vector<float> float_probs, float_values, int8_probs, int8_values;
+		double float_us = forward_us(net, held_out, float_probs, float_values);
+
+		net.calibrate(calibration.data(), unsigned(calibration.size() / STATE_SIZE));
+		double int8_us = forward_us(net, held_out, int8_probs, int8_values);
+
+		// kl(float || int8) of the policy, error of the value
+		size_t count = held_out.size() / STATE_SIZE;
+		double kl_sum = 0, kl_max = 0, value_sum = 0, value_max = 0;
+		size_t top1 = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			const float* p = &float_probs[i * ALL];
+			const float* q = &int8_probs[i * ALL];
+
+			double kl = 0;
+			for (int a = 0; a < ALL; a++)
+			{
+				if (p[a] > 0)
+				{
+					kl += p[a] * log(p[a] / max(q[a], 1e-12f));
+				}
+			}
+			kl_sum += kl;
+			kl_max = max(kl_max, kl);
+			top1 += max_element(p, p + ALL) - p == max_element(q, q + ALL) - q;
+
+			double error = fabs(float_values[i] - int8_values[i]);
+			value_sum += error;
+			value_max = max(value_max, error);
+		}
+
+		cout << "calibration positions: " << calibration.size() / STATE_SIZE << endl;
+		cout << "held-out positions: " << count << endl;
+		cout << "policy kl: mean " << kl_sum / count << " max " << kl_max << endl;
+		cout << "policy top-1 agreement: " << double(top1) / count << endl;
+		cout << "value error: mean " << value_sum / count << " max " << value_max << endl;
+		cout << "us per position: float " << float_us << " int8 " << int8_us << endl;
+
+		string calibration_path = model_path.substr(0, model_path.rfind('.')) + ".calib";
+		net.save_calibration(calibration_path);
+		cout << "saved " << calibration_path << endl;
+	}
+	catch (exception& e)
+	{
+		cout << e.what() << endl;
+		return 1;
+	}
+}
@@ -2,40 +2,201 @@
 // #include <ATen/cuda/CUDAContext.h>
 // #include <ATen/cuda/CUDAGuard.h>
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+
+#include "cpu_scheduler.h"
 
 using namespace std::chrono_literals;
 
+// batching deadline as a share of the forward latency, and its bounds
+const double BATCH_WAIT_RATIO = 0.5;
+const long long MIN_BATCH_WAIT_NS = 50000;
+const long long MAX_BATCH_WAIT_NS = 5000000;
+
+// one buffer in forward per worker, one filling and one spare
+const unsigned int STAGING_SPARE_SIZE = 2;
+
+// forwards per shape while warming up, and to time a batch
+const unsigned int WARM_UP_RUNS = 3;
+const unsigned int LATENCY_RUNS = 10;
+
 NeuralNetwork::NeuralNetwork(std::string model_path, bool use_gpu,
-    unsigned int batch_size)
-    : module(std::make_shared<torch::jit::script::Module>(torch::jit::load(model_path.c_str()))),
-    use_gpu(use_gpu),
+    unsigned int batch_size, unsigned int worker_num, bool replicate)
+    : use_gpu(use_gpu),
     batch_size(batch_size),
     running(true),
-    loop(nullptr) {
+    collecting(false),
+    numa_node(CpuScheduler::get_instance().assign_node()),
+    fill(0),
+    capacity(batch_size),
+    producers(0),
+    queued_commits(0) {
+    this->reset_batch_stats();
+
+    worker_num = std::max(1u, worker_num);
+    this->worker_num = worker_num;
+    this->replicas = replicate ? worker_num : 1;
+    this->model = this->load_model(model_path, "");
+
+    for (unsigned int i = 0; i < worker_num + STAGING_SPARE_SIZE; i++) {
+        auto buffer = std::make_unique<staging_type>();
+        buffer->states.reset(new float[this->capacity * 3 * WIDTH * WIDTH]);
+        buffer->slots.resize(this->capacity, nullptr);
+        buffer->reserved = 0;
+        buffer->written = 0;
+        buffer->commits = 0;
+        buffer->busy = false;
+        this->staging.emplace_back(std::move(buffer));
+    }
+
+    // run infer threads
+    for (unsigned int i = 0; i < worker_num; i++) {
+        this->loops.emplace_back([this, i] {
+            CpuScheduler::get_instance().pin_current_thread(this->numa_node);
+
+            // libtorch's intra-op pool is part of the process cpu budget, the
+            // setting is per thread with openmp, follow the networks coming
+            // and going
+            unsigned int torch_threads = 0;
+            while (this->running) {
+                if (torch_threads != this->get_torch_threads()) {
+                    torch_threads = this->get_torch_threads();
+                    at::set_num_threads(torch_threads);
+                }
+                this->infer(i);
+            }
+        });
+    }
+}
+
+NeuralNetwork::~NeuralNetwork() {
+    if (this->swapper.joinable()) {
+        this->swapper.join();
+    }
+    this->running = false;
+    for (auto& loop : this->loops) {
+        loop.join();
+    }
+    CpuScheduler::get_instance().release_node();
+}
+
+std::shared_ptr<NeuralNetwork::model_type> NeuralNetwork::load_model(
+    const std::string& model_path, const std::string& calibration_path) const {
+    auto model = std::make_shared<model_type>();
+    model->path = model_path;
+
+    // a .native model runs on the cpu engine, no module is loaded
+    if (NativeNet::is_native_path(model_path)) {
+        model->native = std::make_shared<NativeNet>(model_path);
+        if (!calibration_path.empty()) {
+            model->native->load_calibration(calibration_path);
+        }
+        return model;
+    }
+
+    for (unsigned int i = 0; i < this->replicas; i++) {
+        model->modules.emplace_back(this->load_module(model_path, i == 0));
+    }
+    return model;
+}
+
+std::future<bool> NeuralNetwork::swap_model(const std::string& model_path,
+    const std::string& calibration_path) {
+    // one load at a time
+    if (this->swapper.joinable()) {
+        this->swapper.join();
+    }
+
+    auto swapped = std::make_shared<std::promise<bool>>();
+    this->swapper = std::thread([this, model_path, calibration_path, swapped] {
+        CpuScheduler::get_instance().pin_current_thread(this->numa_node);
+        at::set_num_threads(this->get_torch_threads());
+
+        std::shared_ptr<model_type> model;
+        try {
+            model = this->load_model(model_path, calibration_path);
+        }
+        catch (std::exception& e) {
+            std::cout << "can't swap to " << model_path << ": " << e.what() << std::endl;
+            swapped->set_value(false);
+            return;
+        }
+
+        // the old model goes with the last batch still running on it
+        {
+            std::lock_guard<std::mutex> lock(this->lock);
+            this->model = std::move(model);
+        }
+        swapped->set_value(true);
+    });
+    return swapped->get_future();
+}
+
+std::string NeuralNetwork::get_model_path() {
+    std::lock_guard<std::mutex> lock(this->lock);
+    return this->model->path;
+}
+
+std::shared_ptr<torch::jit::script::Module> NeuralNetwork::load_module(
+    const std::string& model_path, bool log) const {
+    auto module = torch::jit::load(model_path.c_str());
     if (this->use_gpu) {
         // move to CUDA
-        this->module->to(at::kCUDA);
+        module.to(at::kCUDA);
+    }
+    module.eval();
+
+    double before = 0;
+    if (log) {
+        time_forward(module, this->batch_size, this->use_gpu, WARM_UP_RUNS);
+        before = time_forward(module, this->batch_size, this->use_gpu, LATENCY_RUNS);
     }
 
-    // run infer thread
-    this->loop = std::make_unique<std::thread>([this] {
-        while (this->running) {
-            this->infer();
+    // freezing inlines the weights and folds conv + batch norm, then
+    // optimize_for_inference fuses what is left for the device
+    auto frozen = torch::jit::freeze(module);
+    auto optimized = std::make_shared<torch::jit::script::Module>(
+        torch::jit::optimize_for_inference(frozen));
+
+    // the profiling executor specialises on the shapes it sees first, show
+    // it the batch sizes adaptive batching will send
+    for (unsigned int rows = 1; ; rows = std::min(rows * 2, this->batch_size)) {
+        time_forward(*optimized, rows, this->use_gpu, WARM_UP_RUNS);
+        if (rows >= this->batch_size) {
+            break;
         }
-    });
+    }
+
+    if (log) {
+        double after = time_forward(*optimized, this->batch_size, this->use_gpu, LATENCY_RUNS);
+        std::cout << model_path << ": forward of " << this->batch_size << " "
+            << before << "ms -> " << after << "ms optimized" << std::endl;
+    }
+    return optimized;
 }
 
-NeuralNetwork::~NeuralNetwork() {
-    this->running = false;
-    this->loop->join();
+double NeuralNetwork::time_forward(torch::jit::script::Module& module, unsigned int rows,
+    bool use_gpu, unsigned int runs) {
+    c10::InferenceMode guard;
+    auto states = torch::zeros({ rows, 3, WIDTH, WIDTH }, torch::dtype(torch::kFloat32));
+    std::vector<torch::jit::IValue> inputs{ use_gpu ? states.to(at::kCUDA) : states };
+
+    auto begin = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < runs; i++) {
+        // copying the policy back waits for the gpu
+        module.forward(inputs).toTuple()->elements()[0].toTensor().to(at::kCPU);
+    }
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - begin).count() / runs;
 }
 
-std::future<NeuralNetwork::return_type> NeuralNetwork::commit(GameField* game_field) {
-    auto board = game_field->gameField;
-    torch::Tensor state0 = torch::zeros({ 1, 1, WIDTH, WIDTH }, torch::dtype(torch::kFloat32));
-    torch::Tensor state1 = torch::zeros({ 1, 1, WIDTH, WIDTH }, torch::dtype(torch::kFloat32));
-    torch::Tensor state2 = torch::zeros({ 1, 1, WIDTH, WIDTH }, torch::dtype(torch::kFloat32));
+void NeuralNetwork::encode_states(GameField* game_field, float* out) {
+    const auto& board = game_field->gameField;
+    float* state0 = out;
+    float* state1 = out + WIDTH * WIDTH;
+    float* state2 = out + 2 * WIDTH * WIDTH;
 
     // state0 and state1
     for (unsigned i = 0; i < WIDTH; i++)
@@ -43,102 +204,321 @@ std::future<NeuralNetwork::return_type> NeuralNetwork::commit(GameField* game_fi
         for (unsigned j = 0; j < WIDTH; j++)
         {
             auto stone = board[xy_to_act(i, j)];
-            if (stone == black)
-            {
-                state0[0][0][i][j] = 1;
+            state0[i * WIDTH + j] = stone == black ? 1.f : 0.f;
+            state1[i * WIDTH + j] = stone == white ? 1.f : 0.f;
+        }
+    }
+
+    // state2
+    std::fill(state2, state2 + WIDTH * WIDTH,
+        game_field->current_color == white ? 1.f : 0.f);
+}
+
+void NeuralNetwork::commit(GameField* game_field, EvalSlot* slot) {
+    this->commit(&game_field, slot, 1);
+}
+
+void NeuralNetwork::commit(const std::vector<GameField*>& game_fields,
+    EvalSlot* slots) {
+    this->commit(game_fields.data(), slots, game_fields.size());
+}
+
+void NeuralNetwork::commit(GameField* const* game_fields, EvalSlot* slots,
+    unsigned int n) {
+    const unsigned int row_size = 3 * WIDTH * WIDTH;
+
+    // a commit larger than the free rows spills into the next buffer, its
+    // rows are written before waiting so infer never waits on a waiting producer
+    unsigned int begin = 0;
+    while (begin < n) {
+        staging_type* buffer;
+        unsigned int row;
+        unsigned int count;
+        {
+            std::unique_lock<std::mutex> lock(this->lock);
+
+            while (this->staging[this->fill]->busy ||
+                this->staging[this->fill]->reserved >= this->batch_size) {
+                unsigned int next = this->find_free_staging();
+                if (next < this->staging.size()) {
+                    this->fill = next;
+                }
+                else {
+                    this->staging_cv.wait(lock);
+                }
             }
-            else if (stone == white)
-            {
-                state1[0][0][i][j] = 1;
+
+            buffer = this->staging[this->fill].get();
+            row = buffer->reserved;
+            count = std::min(n - begin, this->batch_size - row);
+            if (row == 0) {
+                buffer->oldest = std::chrono::steady_clock::now();
             }
+            buffer->reserved += count;
+            for (unsigned int i = 0; i < count; i++) {
+                buffer->slots[row + i] = &slots[begin + i];
+            }
+            if (begin + count == n) {
+                buffer->commits++;
+                this->queued_commits++;
+            }
+        }
+
+        // encode straight into the reserved rows
+        for (unsigned int i = 0; i < count; i++) {
+            if (slots[begin + i].notify == nullptr) {
+                slots[begin + i].waker = EvalWaker::current();
+            }
+            encode_states(game_fields[begin + i],
+                buffer->states.get() + (row + i) * row_size);
         }
+        buffer->written.fetch_add(count, std::memory_order_release);
+        begin += count;
+
+        this->cv.notify_all();
     }
+}
+
+unsigned int NeuralNetwork::get_torch_threads() const {
+    return std::max(1u,
+        CpuScheduler::get_instance().get_network_torch_threads() / this->worker_num);
+}
+
+void NeuralNetwork::infer(unsigned int worker) {
+    // get inputs
+    staging_type* buffer = nullptr;
+    std::shared_ptr<model_type> model;
 
-    // state2
-    if (game_field->current_color == white)
     {
-        for (unsigned i = 0; i < WIDTH; i++)
-        {
-            for (unsigned j = 0; j < WIDTH; j++)
-            {
-                state2[0][0][i][j] = 1;
+        std::unique_lock<std::mutex> lock(this->lock);
+
+        // one worker gathers the next batch while the others run forward,
+        // wake up now and then to see if still running
+        if (!this->cv.wait_for(lock, 1ms, [this, &buffer] {
+            buffer = this->collecting ? nullptr : this->find_oldest_staging();
+            return buffer != nullptr;
+        })) {
+            return;
+        }
+        this->collecting = true;
+
+        // fire once the batch is full, every producer has committed or the
+        // oldest row has waited long enough
+        auto deadline = buffer->oldest + std::chrono::nanoseconds(this->batch_wait_ns.load());
+        this->cv.wait_until(lock, deadline, [this, buffer] {
+            unsigned int producers = this->producers.load();
+            return buffer->reserved >= this->batch_size ||
+                (producers > 0 && this->queued_commits >= producers);
+        });
+
+        // close the buffer, producers move on to the next free one
+        buffer->busy = true;
+        model = this->model;
+        this->queued_commits -= buffer->commits;
+        if (this->staging[this->fill].get() == buffer) {
+            unsigned int next = this->find_free_staging();
+            if (next < this->staging.size()) {
+                this->fill = next;
             }
         }
+        this->collecting = false;
+    }
+    this->cv.notify_all();  // next worker takes over
+
+    // rows reserved before closing may still be being encoded
+    unsigned int rows = buffer->reserved;
+    while (buffer->written.load(std::memory_order_acquire) < rows) {
+        std::this_thread::yield();
+    }
+
+    auto forward_begin = std::chrono::steady_clock::now();
+
+    const float* p_data;
+    const float* v_data;
+    torch::Tensor p_batch;
+    torch::Tensor v_batch;
+
+    if (model->native) {
+        // the native engine already gives probabilities, one output buffer
+        // per worker thread
+        thread_local std::vector<float> probs;
+        thread_local std::vector<float> values;
+        probs.resize(rows * ALL);
+        values.resize(rows);
+        model->native->forward(buffer->states.get(), rows, probs.data(), values.data(),
+            this->get_torch_threads());
+
+        p_data = probs.data();
+        v_data = values.data();
     }
+    else {
+        // no autograd bookkeeping, only the raw outputs are read afterwards
+        c10::InferenceMode guard;
 
-    // torch::Tensor states = torch::cat({state0, state1}, 1);
-    torch::Tensor states = torch::cat({ state0, state1, state2 }, 1);
+        // infer on the staging rows in place
+        auto states = torch::from_blob(buffer->states.get(),
+            { rows, 3, WIDTH, WIDTH }, torch::dtype(torch::kFloat32));
+        std::vector<torch::jit::IValue> inputs{
+            this->use_gpu ? states.to(at::kCUDA) : states };
+        auto& module = model->modules[worker % model->modules.size()];
+        auto result = module->forward(inputs).toTuple();
+
+        p_batch = result->elements()[0]
+            .toTensor()
+            .exp()
+            .toType(torch::kFloat32)
+            .to(at::kCPU)
+            .contiguous();
+        v_batch =
+            result->elements()[1].toTensor().toType(torch::kFloat32).to(at::kCPU).contiguous();
+
+        p_data = p_batch.data_ptr<float>();
+        v_data = v_batch.data_ptr<float>();
+    }
+
+    // fill the slots, then wake their owners
+    for (unsigned int i = 0; i < rows; i++) {
+        auto slot = buffer->slots[i];
+        std::copy(p_data + i * ALL, p_data + (i + 1) * ALL, slot->probs);
+        slot->value = v_data[i];
+
+        if (slot->notify != nullptr) {
+            slot->notify(slot->context);
+        }
+        else {
+            // the owner may free the slot as soon as the post lands
+            auto waker = std::move(slot->waker);
+            waker->post();
+        }
+    }
 
-    // emplace task
-    std::promise<return_type> promise;
-    auto ret = promise.get_future();
+    this->record_batch(rows, forward_begin - buffer->oldest,
+        std::chrono::steady_clock::now() - forward_begin);
 
+    // hand the buffer back
     {
         std::lock_guard<std::mutex> lock(this->lock);
-        tasks.emplace(std::make_pair(states, std::move(promise)));
+        buffer->reserved = 0;
+        buffer->written.store(0);
+        buffer->commits = 0;
+        buffer->busy = false;
     }
+    this->staging_cv.notify_all();
+}
 
-    this->cv.notify_all();
+unsigned int NeuralNetwork::find_free_staging() const {
+    for (unsigned int i = 0; i < this->staging.size(); i++) {
+        if (!this->staging[i]->busy && this->staging[i]->reserved == 0) {
+            return i;
+        }
+    }
+    return this->staging.size();
+}
 
-    return ret;
+NeuralNetwork::staging_type* NeuralNetwork::find_oldest_staging() const {
+    // batches go to forward in the order their first row came in
+    staging_type* oldest = nullptr;
+    for (auto& buffer : this->staging) {
+        if (!buffer->busy && buffer->reserved > 0 &&
+            (oldest == nullptr || buffer->oldest < oldest->oldest)) {
+            oldest = buffer.get();
+        }
+    }
+    return oldest;
 }
 
-void NeuralNetwork::infer() {
-    // get inputs
-    std::vector<torch::Tensor> states;
-    std::vector<std::promise<return_type>> promises;
+void NeuralNetwork::load_calibration(const std::string& path) {
+    if (!this->model->native) {
+        throw std::runtime_error("int8 needs a .native model");
+    }
+    this->model->native->load_calibration(path);
+}
 
-    bool timeout = false;
-    while (states.size() < this->batch_size && !timeout) {
-        // pop task
-        {
-            std::unique_lock<std::mutex> lock(this->lock);
-            if (this->cv.wait_for(lock, 1ms,
-                [this] { return this->tasks.size() > 0; })) {
-                auto task = std::move(this->tasks.front());
-                states.emplace_back(std::move(task.first));
-                promises.emplace_back(std::move(task.second));
+void NeuralNetwork::register_producer() {
+    this->producers++;
+}
 
-                this->tasks.pop();
+void NeuralNetwork::unregister_producer() {
+    // the rest may all have committed already
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+        this->producers--;
+    }
+    this->cv.notify_all();
+}
 
-            }
-            else {
-                // timeout
-                // std::cout << "timeout" << std::endl;
-                timeout = true;
-            }
-        }
+static unsigned int log2_bucket(unsigned long long x) {
+    unsigned int bucket = 0;
+    while (x > 1 && bucket < 31) {
+        x >>= 1;
+        bucket++;
     }
+    return bucket;
+}
+
+void NeuralNetwork::record_batch(unsigned int size, std::chrono::nanoseconds wait,
+    std::chrono::nanoseconds forward) {
+    this->batch_num++;
+    this->eval_num += size;
+    this->size_histogram[log2_bucket(size)]++;
+    this->wait_histogram[log2_bucket(std::max<long long>(0, wait.count()) / 1000)]++;
+
+    // smooth the forward latency, the deadline is a share of it
+    long long smoothed = this->forward_ns.load();
+    smoothed = smoothed == 0 ? forward.count() : (smoothed * 7 + forward.count()) / 8;
+    this->forward_ns.store(smoothed);
+    this->batch_wait_ns.store(std::clamp(static_cast<long long>(smoothed * BATCH_WAIT_RATIO),
+        MIN_BATCH_WAIT_NS, MAX_BATCH_WAIT_NS));
+}
+
+BatchStats NeuralNetwork::get_batch_stats() const {
+    BatchStats stats;
 
-    // inputs empty
-    if (states.size() == 0) {
-        return;
+    stats.batches = this->batch_num.load();
+    stats.evals = this->eval_num.load();
+    stats.forward_ms = this->forward_ns.load() * 1e-6;
+    stats.wait_limit_ms = this->batch_wait_ns.load() * 1e-6;
+    for (unsigned int i = 0; i < this->size_histogram.size(); i++) {
+        stats.size_histogram.emplace_back(this->size_histogram[i].load());
+        stats.wait_histogram.emplace_back(this->wait_histogram[i].load());
     }
 
-    // infer
-    std::vector<torch::jit::IValue> inputs{
-        this->use_gpu ? torch::cat(states, 0).to(at::kCUDA)
-                      : torch::cat(states, 0) };
-    auto result = this->module->forward(inputs).toTuple();
+    // drop empty tail buckets
+    while (!stats.size_histogram.empty() && stats.size_histogram.back() == 0) {
+        stats.size_histogram.pop_back();
+    }
+    while (!stats.wait_histogram.empty() && stats.wait_histogram.back() == 0) {
+        stats.wait_histogram.pop_back();
+    }
 
-    torch::Tensor p_batch = result->elements()[0]
-        .toTensor()
-        .exp()
-        .toType(torch::kFloat32)
-        .to(at::kCPU);
-    torch::Tensor v_batch =
-        result->elements()[1].toTensor().toType(torch::kFloat32).to(at::kCPU);
+    return stats;
+}
 
-    // set promise value
-    for (unsigned int i = 0; i < promises.size(); i++) {
-        torch::Tensor p = p_batch[i];
-        torch::Tensor v = v_batch[i];
+void NeuralNetwork::reset_batch_stats() {
+    this->forward_ns = 0;
+    this->batch_wait_ns = MAX_BATCH_WAIT_NS / 5;
+    this->batch_num = 0;
+    this->eval_num = 0;
+    for (unsigned int i = 0; i < this->size_histogram.size(); i++) {
+        this->size_histogram[i] = 0;
+        this->wait_histogram[i] = 0;
+    }
+}
 
-        std::vector<double> prob(static_cast<float*>(p.data_ptr()),
-            static_cast<float*>(p.data_ptr()) + p.size(0));
-        std::vector<double> value{ v.item<float>() };
-        return_type temp{ std::move(prob), std::move(value) };
+std::string BatchStats::to_string() const {
+    std::ostringstream out;
+    out << "batches: " << this->batches
+        << " mean size: " << (this->batches > 0 ? double(this->evals) / this->batches : 0)
+        << " forward: " << this->forward_ms << "ms"
+        << " wait limit: " << this->wait_limit_ms << "ms";
 
-        promises[i].set_value(std::move(temp));
+    out << " size:";
+    for (unsigned int i = 0; i < this->size_histogram.size(); i++) {
+        out << " " << (1ull << i) << "+:" << this->size_histogram[i];
+    }
+    out << " wait us:";
+    for (unsigned int i = 0; i < this->wait_histogram.size(); i++) {
+        out << " " << (1ull << i) << "+:" << this->wait_histogram[i];
     }
+    return out.str();
 }
\ No newline at end of file
@@ -2,39 +2,171 @@
 
 #include <torch/script.h>  // One-stop header.
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <future>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <semaphore>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "GameField.h"
+#include "native_net.h"
 
-class NeuralNetwork {
+// counts the filled slots of one thread, infer holds a reference while it
+// posts, so a waiter may return and drop its slot at any time
+class EvalWaker {
 public:
-    using return_type = std::vector<std::vector<double>>;
+    void post() { this->filled.release(); }
+    void wait(unsigned int n) {  // n more slots of this thread are filled
+        for (unsigned int i = 0; i < n; i++) {
+            this->filled.acquire();
+        }
+    }
+    static const std::shared_ptr<EvalWaker>& current() {  // of the calling thread
+        thread_local auto waker = std::make_shared<EvalWaker>();
+        return waker;
+    }
+
+private:
+    std::counting_semaphore<> filled{ 0 };
+};
+
+// caller-owned evaluation result, infer fills it in place
+struct EvalSlot {
+    float probs[ALL];
+    float value;
+
+    // when set, called on the infer thread instead of posting the waker,
+    // the slot may be gone once it returns
+    void (*notify)(void* context);
+    void* context;
+
+    // set by commit, the waker of the committing thread
+    std::shared_ptr<EvalWaker> waker;
 
-    NeuralNetwork(std::string model_path, bool use_gpu, unsigned int batch_size);
+    EvalSlot() : value(0), notify(nullptr), context(nullptr) {}
+};
+
+// batching statistics, histogram bucket i holds [2^i, 2^(i+1))
+struct BatchStats {
+    unsigned long long batches;
+    unsigned long long evals;
+    double forward_ms;  // smoothed forward latency
+    double wait_limit_ms;  // current batching deadline
+    std::vector<unsigned long long> size_histogram;  // tasks per batch
+    std::vector<unsigned long long> wait_histogram;  // oldest task wait, us
+
+    std::string to_string() const;
+};
+
+class NeuralNetwork {
+public:
+    // worker_num: infer threads pulling batches, the torch threads are split
+    // between them; replicate: every worker runs its own copy of the module
+    NeuralNetwork(std::string model_path, bool use_gpu, unsigned int batch_size,
+        unsigned int worker_num = 1, bool replicate = false);
     ~NeuralNetwork();
 
-    std::future<return_type> commit(GameField* game_field);  // commit task to queue
+    void commit(GameField* game_field, EvalSlot* slot);  // commit task to queue
+    void commit(const std::vector<GameField*>& game_fields,
+        EvalSlot* slots);  // commit tasks at once, one slot each
+    void commit(GameField* const* game_fields, EvalSlot* slots, unsigned int n);
     void set_batch_size(unsigned int batch_size) {    // set batch_size
-        this->batch_size = batch_size;
+        // the staging rows are allocated for the initial size
+        this->batch_size = std::min(batch_size, this->capacity);
     };
+    static void encode_states(GameField* game_field, float* out);  // [3, WIDTH, WIDTH]
+
+    // int8 trunk for a .native model, from int8_report, before the first commit
+    void load_calibration(const std::string& path);
+
+    // load another model on a background thread, batches closed once it is
+    // ready run on it and the ones in forward finish on the old one, a load
+    // error keeps the old model; calibration_path: int8 for a .native model
+    // returns: whether the model was switched, once the load is over
+    std::future<bool> swap_model(const std::string& model_path,
+        const std::string& calibration_path = "");
+    std::string get_model_path();
+
+    // threads that block on their commits, a batch fires early once every
+    // registered producer has committed
+    void register_producer();
+    void unregister_producer();
+
+    BatchStats get_batch_stats() const;
+    void reset_batch_stats();
+
+    // staging ring, producers encode straight into reserved rows of the
+    // buffer being filled and forward reads whole buffers through from_blob
+    struct staging_type {
+        std::unique_ptr<float[]> states;    // [capacity, 3, WIDTH, WIDTH]
+        std::vector<EvalSlot*> slots;       // slot of every row
+        unsigned int reserved;              // rows handed out
+        std::atomic<unsigned int> written;  // rows encoded
+        unsigned int commits;               // commits ending in this buffer
+        std::chrono::steady_clock::time_point oldest;  // first row reserved at
+        bool busy;                          // taken by infer
+    };
+
+    void infer(unsigned int worker);  // infer one batch
+    // intra-op threads of every worker, the share of the network follows the
+    // networks alive in the process
+    unsigned int get_torch_threads() const;
+
+    // what forward runs on, replaced as a whole by swap_model
+    struct model_type {
+        std::string path;
+        std::vector<std::shared_ptr<torch::jit::script::Module>> modules;  // one, or one per worker
+        std::shared_ptr<NativeNet> native;  // set for a .native model, used instead of the modules
+    };
+    std::shared_ptr<model_type> load_model(const std::string& model_path,
+        const std::string& calibration_path) const;
+
+    // load, freeze and optimise a module, then warm it up, log: time the
+    // forward of a full batch before and after
+    std::shared_ptr<torch::jit::script::Module> load_module(
+        const std::string& model_path, bool log) const;
+    static double time_forward(torch::jit::script::Module& module, unsigned int rows,
+        bool use_gpu, unsigned int runs);  // mean ms
+    unsigned int find_free_staging() const;  // staging.size() if none, under lock
+    staging_type* find_oldest_staging() const;  // nullptr if none, under lock
+    void record_batch(unsigned int size, std::chrono::nanoseconds wait,
+        std::chrono::nanoseconds forward);
 
-    using task_type = std::pair<torch::Tensor, std::promise<return_type>>;
+    std::vector<std::thread> loops;  // call infer in loop, one per worker
+    std::thread swapper;             // loads the next model
+    std::atomic<bool> running;       // is running
+    bool collecting;                 // a worker is gathering the next batch
 
-    void infer();  // infer
+    std::vector<std::unique_ptr<staging_type>> staging;
+    unsigned int fill;   // buffer producers write to
+    unsigned int capacity;  // rows per buffer
+    std::mutex lock;              // lock for the staging ring
+    std::condition_variable cv;   // infer waits for rows
+    std::condition_variable staging_cv;  // producers wait for a free buffer
 
-    std::unique_ptr<std::thread> loop;  // call infer in loop
-    bool running;                       // is running
+    std::atomic<unsigned int> producers;  // registered producers
+    unsigned int queued_commits;          // commits waiting for infer
 
-    std::queue<task_type> tasks;  // tasks queue
-    std::mutex lock;              // lock for tasks queue
-    std::condition_variable cv;   // condition variable for tasks queue
+    // the deadline follows the measured forward latency
+    std::atomic<long long> forward_ns;     // smoothed forward latency
+    std::atomic<long long> batch_wait_ns;  // wait for more tasks after the oldest
+    std::atomic<unsigned long long> batch_num;
+    std::atomic<unsigned long long> eval_num;
+    std::array<std::atomic<unsigned long long>, 32> size_histogram;
+    std::array<std::atomic<unsigned long long>, 32> wait_histogram;
 
-    std::shared_ptr<torch::jit::script::Module> module;  // torch module
+    std::shared_ptr<model_type> model;  // under lock, taken by infer when it closes a batch
+    unsigned int replicas;              // modules per model
+    unsigned int worker_num;            // infer threads
     unsigned int batch_size;                             // batch size
     bool use_gpu;                                        // use gpu
+    unsigned int numa_node;  // node of the infer threads, searches feeding it run there too unless it is alone
 };
\ No newline at end of file
@@ -0,0 +1,635 @@
+#include "native_net.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+#if (defined(__AVX512F__) && defined(__AVX512BW__)) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#endif
+
+#include "GameField.h"
+#include "thread_pool.h"
+
+// weight file layout: magic, version, blocks, width, actions, then every block
+// as conv1, conv2, a downsample flag and conv, then the policy and value heads,
+// a layer is its input and output size, weight and bias
+static const char NATIVE_MAGIC[4] = { 'N', 'A', 'T', 'V' };
+static const uint32_t NATIVE_VERSION = 1;
+static const char NATIVE_SUFFIX[] = ".native";
+
+static const unsigned int PAD = WIDTH + 2;  // padded board side
+static const unsigned int INPUT_PLANES = 3;
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+typedef __m512 vec;
+static const unsigned int VEC = 16;
+static inline vec vload(const float* p) { return _mm512_loadu_ps(p); }
+static inline void vstore(float* p, vec x) { _mm512_storeu_ps(p, x); }
+static inline vec vset1(float x) { return _mm512_set1_ps(x); }
+static inline vec vfmadd(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+static inline vec vadd(vec a, vec b) { return _mm512_add_ps(a, b); }
+static inline vec vmax(vec a, vec b) { return _mm512_max_ps(a, b); }
+static inline float vsum(vec x) { return _mm512_reduce_add_ps(x); }
+
+typedef __m512i ivec;
+static inline ivec iset1(int32_t x) { return _mm512_set1_epi32(x); }
+static inline ivec iload(const int8_t* p) { return _mm512_loadu_si512(p); }
+static inline vec itof(ivec x) { return _mm512_cvtepi32_ps(x); }
+static inline ivec idot4(ivec acc, ivec a, ivec b) {
+#ifdef __AVX512VNNI__
+    return _mm512_dpbusd_epi32(acc, a, b);
+#else
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_maddubs_epi16(a, b), _mm512_set1_epi16(1)));
+#endif
+}
+#elif defined(__AVX2__) && defined(__FMA__)
+typedef __m256 vec;
+static const unsigned int VEC = 8;
+static inline vec vload(const float* p) { return _mm256_loadu_ps(p); }
+static inline void vstore(float* p, vec x) { _mm256_storeu_ps(p, x); }
+static inline vec vset1(float x) { return _mm256_set1_ps(x); }
+static inline vec vfmadd(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+static inline vec vadd(vec a, vec b) { return _mm256_add_ps(a, b); }
+static inline vec vmax(vec a, vec b) { return _mm256_max_ps(a, b); }
+static inline float vsum(vec x) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+typedef __m256i ivec;
+static inline ivec iset1(int32_t x) { return _mm256_set1_epi32(x); }
+static inline ivec iload(const int8_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+static inline vec itof(ivec x) { return _mm256_cvtepi32_ps(x); }
+static inline ivec idot4(ivec acc, ivec a, ivec b) {
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), _mm256_set1_epi16(1)));
+}
+#else
+typedef float vec;
+static const unsigned int VEC = 1;
+static inline vec vload(const float* p) { return *p; }
+static inline void vstore(float* p, vec x) { *p = x; }
+static inline vec vset1(float x) { return x; }
+static inline vec vfmadd(vec a, vec b, vec c) { return a * b + c; }
+static inline vec vadd(vec a, vec b) { return a + b; }
+static inline vec vmax(vec a, vec b) { return std::max(a, b); }
+static inline float vsum(vec x) { return x; }
+
+typedef int32_t ivec;
+static inline ivec iset1(int32_t x) { return x; }
+static inline ivec iload(const int8_t* p) { int32_t x; std::memcpy(&x, p, sizeof(x)); return x; }
+static inline vec itof(ivec x) { return float(x); }
+static inline ivec idot4(ivec acc, ivec a, ivec b) {
+    for (unsigned int k = 0; k < 4; k++) {
+        acc += int32_t(uint8_t(a >> (8 * k))) * int32_t(int8_t(b >> (8 * k)));
+    }
+    return acc;
+}
+#endif
+
+// activations are 7 bits, so the pair sums of maddubs can't saturate
+static const float QUANTIZED_MAX = 127.f;
+
+static float dot(const float* a, const float* b, unsigned int n) {
+    vec acc = vset1(0.f);
+    unsigned int i = 0;
+    for (; i + VEC <= n; i += VEC) {
+        acc = vfmadd(vload(a + i), vload(b + i), acc);
+    }
+    float sum = vsum(acc);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// BLOCK output vectors of one pixel stay in registers while the input
+// channels of the 9 taps are broadcast against the weight rows
+template <unsigned int BLOCK>
+static void conv3x3_block(const float* in, unsigned int in_channels,
+    const float* weight, const float* bias, unsigned int out_channels, unsigned int oc,
+    const float* residual, bool relu, float* out) {
+    for (unsigned int y = 0; y < WIDTH; y++) {
+        for (unsigned int x = 0; x < WIDTH; x++) {
+            vec acc[BLOCK];
+            for (unsigned int b = 0; b < BLOCK; b++) {
+                acc[b] = vload(bias + oc + b * VEC);
+            }
+
+            for (unsigned int ky = 0; ky < 3; ky++) {
+                for (unsigned int kx = 0; kx < 3; kx++) {
+                    const float* src = in + ((y + ky) * PAD + x + kx) * in_channels;
+                    const float* w = weight + (ky * 3 + kx) * in_channels * out_channels + oc;
+                    for (unsigned int ic = 0; ic < in_channels; ic++) {
+                        vec s = vset1(src[ic]);
+                        const float* row = w + ic * out_channels;
+                        for (unsigned int b = 0; b < BLOCK; b++) {
+                            acc[b] = vfmadd(s, vload(row + b * VEC), acc[b]);
+                        }
+                    }
+                }
+            }
+
+            unsigned int at = ((y + 1) * PAD + x + 1) * out_channels + oc;
+            for (unsigned int b = 0; b < BLOCK; b++) {
+                vec r = acc[b];
+                if (residual != nullptr) {
+                    r = vadd(r, vload(residual + at + b * VEC));
+                }
+                if (relu) {
+                    r = vmax(r, vset1(0.f));
+                }
+                vstore(out + at + b * VEC, r);
+            }
+        }
+    }
+}
+
+// the int8 twin, every step takes 4 input channels of a pixel at once
+template <unsigned int BLOCK>
+static void conv3x3_int8_block(const uint8_t* in, unsigned int in_channels,
+    const int8_t* weight, const float* scale, const float* bias,
+    unsigned int out_channels, unsigned int oc,
+    const float* residual, bool relu, float* out) {
+    for (unsigned int y = 0; y < WIDTH; y++) {
+        for (unsigned int x = 0; x < WIDTH; x++) {
+            ivec acc[BLOCK];
+            for (unsigned int b = 0; b < BLOCK; b++) {
+                acc[b] = iset1(0);
+            }
+
+            for (unsigned int ky = 0; ky < 3; ky++) {
+                for (unsigned int kx = 0; kx < 3; kx++) {
+                    const uint8_t* src = in + ((y + ky) * PAD + x + kx) * in_channels;
+                    const int8_t* w = weight + (ky * 3 + kx) * in_channels * out_channels + oc * 4;
+                    for (unsigned int ic = 0; ic < in_channels; ic += 4) {
+                        int32_t packed;
+                        std::memcpy(&packed, src + ic, sizeof(packed));
+                        ivec s = iset1(packed);
+                        const int8_t* row = w + ic * out_channels;
+                        for (unsigned int b = 0; b < BLOCK; b++) {
+                            acc[b] = idot4(acc[b], s, iload(row + b * VEC * 4));
+                        }
+                    }
+                }
+            }
+
+            unsigned int at = ((y + 1) * PAD + x + 1) * out_channels + oc;
+            for (unsigned int b = 0; b < BLOCK; b++) {
+                vec r = vfmadd(itof(acc[b]), vload(scale + oc + b * VEC), vload(bias + oc + b * VEC));
+                if (residual != nullptr) {
+                    r = vadd(r, vload(residual + at + b * VEC));
+                }
+                if (relu) {
+                    r = vmax(r, vset1(0.f));
+                }
+                vstore(out + at + b * VEC, r);
+            }
+        }
+    }
+}
+
+// non-negative float activations to 7-bit steps, extra channels stay zero
+static void quantize_activations(const float* in, unsigned int channels, float scale,
+    uint8_t* out, unsigned int out_channels) {
+    const float inverse = 1.f / scale;
+    for (unsigned int i = 1; i <= WIDTH; i++) {
+        for (unsigned int j = 1; j <= WIDTH; j++) {
+            const float* src = in + (i * PAD + j) * channels;
+            uint8_t* dst = out + (i * PAD + j) * out_channels;
+            for (unsigned int c = 0; c < channels; c++) {
+                dst[c] = uint8_t(std::clamp(src[c] * inverse + 0.5f, 0.f, QUANTIZED_MAX));
+            }
+        }
+    }
+}
+
+static unsigned int round_up4(unsigned int x) {
+    return (x + 3) / 4 * 4;
+}
+
+NativeNet::NativeNet(const std::string& path) : channels(INPUT_PLANES), quantized(false) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("can't open " + path);
+    }
+
+    char magic[sizeof(NATIVE_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic + sizeof(magic), NATIVE_MAGIC)) {
+        throw std::runtime_error(path + " is not a native weight file");
+    }
+
+    uint32_t header[4];
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!in) {
+        throw std::runtime_error("unexpected end of native weight file");
+    }
+    if (header[0] != NATIVE_VERSION) {
+        throw std::runtime_error("unsupported native weight file version");
+    }
+    if (header[2] != WIDTH || header[3] != ALL) {
+        throw std::runtime_error("native weight file board size mismatch");
+    }
+
+    unsigned int block_num = header[1];
+    for (unsigned int i = 0; i < block_num; i++) {
+        Block block;
+        block.conv1 = read_conv(in, 3);
+        block.conv2 = read_conv(in, 3);
+        uint32_t downsample = 0;
+        in.read(reinterpret_cast<char*>(&downsample), sizeof(downsample));
+        block.downsample = downsample != 0;
+        if (block.downsample) {
+            block.downsample_conv = read_conv(in, 3);
+        }
+        this->channels = std::max({ this->channels, block.conv1.out_channels, block.conv2.out_channels });
+        this->blocks.emplace_back(std::move(block));
+    }
+
+    this->p_conv = read_conv(in, 1);
+    this->p_fc = read_linear(in);
+    this->v_conv = read_conv(in, 1);
+    this->v_fc1 = read_linear(in);
+    this->v_fc2 = read_linear(in);
+
+    // the trunk is one width, the buffers are laid out for it
+    unsigned int planes = INPUT_PLANES;
+    for (auto& block : this->blocks) {
+        unsigned int residual_channels = block.downsample ? block.downsample_conv.out_channels : planes;
+        if (block.conv1.in_channels != planes || block.conv2.in_channels != block.conv1.out_channels ||
+            block.conv2.out_channels != residual_channels ||
+            (block.downsample && block.downsample_conv.in_channels != planes) ||
+            block.conv1.out_channels != this->channels || block.conv2.out_channels != this->channels ||
+            this->channels % VEC != 0) {
+            throw std::runtime_error("bad residual block in native weight file");
+        }
+        planes = block.conv2.out_channels;
+    }
+    if (this->blocks.empty() || this->p_conv.in_channels != planes || this->v_conv.in_channels != planes ||
+        this->p_fc.in_features != this->p_conv.out_channels * WIDTH * WIDTH || this->p_fc.out_features != ALL ||
+        this->v_fc1.in_features != this->v_conv.out_channels * WIDTH * WIDTH ||
+        this->v_fc2.in_features != this->v_fc1.out_features || this->v_fc2.out_features != 1) {
+        throw std::runtime_error("bad heads in native weight file");
+    }
+}
+
+// the pool is only complete here
+NativeNet::~NativeNet() = default;
+
+NativeNet::Conv NativeNet::read_conv(std::istream& in, unsigned int kernel) {
+    Conv conv;
+    uint32_t size[2];
+    in.read(reinterpret_cast<char*>(size), sizeof(size));
+    conv.in_channels = size[0];
+    conv.out_channels = size[1];
+
+    conv.weight.resize(size_t(kernel) * kernel * conv.in_channels * conv.out_channels);
+    conv.bias.resize(conv.out_channels);
+    in.read(reinterpret_cast<char*>(conv.weight.data()), conv.weight.size() * sizeof(float));
+    in.read(reinterpret_cast<char*>(conv.bias.data()), conv.bias.size() * sizeof(float));
+    if (!in) {
+        throw std::runtime_error("unexpected end of native weight file");
+    }
+    return conv;
+}
+
+NativeNet::Linear NativeNet::read_linear(std::istream& in) {
+    Linear fc;
+    uint32_t size[2];
+    in.read(reinterpret_cast<char*>(size), sizeof(size));
+    fc.in_features = size[0];
+    fc.out_features = size[1];
+
+    fc.weight.resize(size_t(fc.in_features) * fc.out_features);
+    fc.bias.resize(fc.out_features);
+    in.read(reinterpret_cast<char*>(fc.weight.data()), fc.weight.size() * sizeof(float));
+    in.read(reinterpret_cast<char*>(fc.bias.data()), fc.bias.size() * sizeof(float));
+    if (!in) {
+        throw std::runtime_error("unexpected end of native weight file");
+    }
+    return fc;
+}
+
+bool NativeNet::is_native_path(const std::string& path) {
+    const size_t len = sizeof(NATIVE_SUFFIX) - 1;
+    return path.size() >= len && path.compare(path.size() - len, len, NATIVE_SUFFIX) == 0;
+}
+
+void NativeNet::forward(const float* states, unsigned int batch,
+    float* probs, float* values, unsigned int thread_num) const {
+    auto forward_rows = [&](unsigned int begin, unsigned int end) {
+        Scratch& scratch = this->get_scratch();
+        for (unsigned int i = begin; i < end; i++) {
+            this->forward_one(states + i * INPUT_PLANES * WIDTH * WIDTH, scratch, nullptr,
+                probs + i * ALL, values + i);
+        }
+    };
+
+    unsigned int chunks = std::min(thread_num, batch);
+    if (chunks <= 1) {
+        forward_rows(0, batch);
+        return;
+    }
+
+    // the helpers inherit the affinity of the first caller, its numa node
+    {
+        std::lock_guard<std::mutex> lock(this->pool_lock);
+        if (!this->pool) {
+            this->pool = std::make_unique<ThreadPool>(thread_num - 1);
+        }
+    }
+    this->pool->parallel_for(chunks, [&](size_t chunk) {
+        forward_rows(batch * chunk / chunks, batch * (chunk + 1) / chunks);
+    });
+}
+
+NativeNet::Scratch& NativeNet::get_scratch() const {
+    // only the insides are ever written, a scratch of the same shape can be
+    // reused whichever net it came from
+    thread_local Scratch scratch;
+    if (scratch.channels != this->channels ||
+        scratch.floats.size() != 5 * PAD * PAD * this->channels + this->head_size()) {
+        scratch = this->make_scratch();
+    }
+    return scratch;
+}
+
+NativeNet::Scratch NativeNet::make_scratch() const {
+    // float: input, block output and spare, hidden, residual, heads
+    // bytes: input, block input, hidden
+    Scratch scratch;
+    scratch.floats.assign(5 * PAD * PAD * this->channels + this->head_size(), 0.f);
+    scratch.bytes.assign(PAD * PAD * (round_up4(INPUT_PLANES) + 2 * round_up4(this->channels)), 0);
+    scratch.channels = this->channels;
+    return scratch;
+}
+
+size_t NativeNet::head_size() const {
+    return (this->p_conv.out_channels + this->v_conv.out_channels) * WIDTH * WIDTH +
+        ALL + this->v_fc1.out_features;
+}
+
+void NativeNet::forward_one(const float* state, Scratch& scratch, float* ranges,
+    float* probs, float* value) const {
+    // the input has its own buffers, its 3-channel inside would land on the
+    // border of a trunk-wide layout
+    const size_t activation_size = PAD * PAD * this->channels;
+    float* input = scratch.floats.data();
+    float* out = input + activation_size;
+    float* spare = out + activation_size;
+    float* t = spare + activation_size;
+    float* r = t + activation_size;
+
+    uint8_t* input_q = scratch.bytes.data();
+    uint8_t* x_q = input_q + PAD * PAD * round_up4(INPUT_PLANES);
+    uint8_t* t_q = x_q + PAD * PAD * round_up4(this->channels);
+
+    // head features after the activations
+    float* p_features = r + activation_size;
+    float* v_features = p_features + this->p_conv.out_channels * WIDTH * WIDTH;
+    float* logits = v_features + this->v_conv.out_channels * WIDTH * WIDTH;
+    float* hidden = logits + ALL;
+
+    // [3][WIDTH][WIDTH] to channels-last
+    for (unsigned int c = 0; c < INPUT_PLANES; c++) {
+        for (unsigned int i = 0; i < WIDTH; i++) {
+            for (unsigned int j = 0; j < WIDTH; j++) {
+                input[((i + 1) * PAD + j + 1) * INPUT_PLANES + c] = state[(c * WIDTH + i) * WIDTH + j];
+            }
+        }
+    }
+
+    // residual blocks
+    const float* x = input;
+    unsigned int planes = INPUT_PLANES;
+    for (unsigned int i = 0; i < this->blocks.size(); i++) {
+        auto& block = this->blocks[i];
+        const float* residual = x;
+
+        if (this->quantized) {
+            uint8_t* in_q = i == 0 ? input_q : x_q;
+            quantize_activations(x, planes, block.conv1.input_scale, in_q, block.conv1.quantized_in_channels);
+            if (block.downsample) {
+                conv3x3_int8(block.downsample_conv, in_q, nullptr, false, r);
+                residual = r;
+            }
+            conv3x3_int8(block.conv1, in_q, nullptr, true, t);
+            quantize_activations(t, block.conv1.out_channels, block.conv2.input_scale, t_q,
+                block.conv2.quantized_in_channels);
+            conv3x3_int8(block.conv2, t_q, residual, true, out);
+        }
+        else {
+            if (block.downsample) {
+                conv3x3(block.downsample_conv, x, nullptr, false, r);
+                residual = r;
+            }
+            conv3x3(block.conv1, x, nullptr, true, t);
+            conv3x3(block.conv2, t, residual, true, out);
+        }
+
+        if (ranges != nullptr) {
+            for (unsigned int k = 0; k < PAD * PAD * planes; k++) {
+                ranges[2 * i] = std::max(ranges[2 * i], x[k]);
+            }
+            for (unsigned int k = 0; k < activation_size; k++) {
+                ranges[2 * i + 1] = std::max(ranges[2 * i + 1], t[k]);
+            }
+        }
+
+        x = out;
+        planes = block.conv2.out_channels;
+        std::swap(out, spare);
+    }
+
+    // policy head, log_softmax then exp is a softmax
+    conv1x1(this->p_conv, x, p_features);
+    linear(this->p_fc, p_features, logits);
+
+    float max_logit = *std::max_element(logits, logits + ALL);
+    float sum = 0;
+    for (unsigned int i = 0; i < ALL; i++) {
+        probs[i] = std::exp(logits[i] - max_logit);
+        sum += probs[i];
+    }
+    for (unsigned int i = 0; i < ALL; i++) {
+        probs[i] /= sum;
+    }
+
+    // value head
+    conv1x1(this->v_conv, x, v_features);
+    linear(this->v_fc1, v_features, hidden);
+    for (unsigned int i = 0; i < this->v_fc1.out_features; i++) {
+        hidden[i] = std::max(hidden[i], 0.f);
+    }
+    linear(this->v_fc2, hidden, value);
+    *value = std::tanh(*value);
+}
+
+void NativeNet::conv3x3(const Conv& conv, const float* in, const float* residual,
+    bool relu, float* out) {
+    // as many output vectors at once as fit the registers
+    unsigned int oc = 0;
+    for (; oc + 8 * VEC <= conv.out_channels; oc += 8 * VEC) {
+        conv3x3_block<8>(in, conv.in_channels, conv.weight.data(), conv.bias.data(),
+            conv.out_channels, oc, residual, relu, out);
+    }
+    for (; oc + 4 * VEC <= conv.out_channels; oc += 4 * VEC) {
+        conv3x3_block<4>(in, conv.in_channels, conv.weight.data(), conv.bias.data(),
+            conv.out_channels, oc, residual, relu, out);
+    }
+    for (; oc < conv.out_channels; oc += VEC) {
+        conv3x3_block<1>(in, conv.in_channels, conv.weight.data(), conv.bias.data(),
+            conv.out_channels, oc, residual, relu, out);
+    }
+}
+
+void NativeNet::conv3x3_int8(const Conv& conv, const uint8_t* in, const float* residual,
+    bool relu, float* out) {
+    unsigned int oc = 0;
+    for (; oc + 8 * VEC <= conv.out_channels; oc += 8 * VEC) {
+        conv3x3_int8_block<8>(in, conv.quantized_in_channels, conv.quantized_weight.data(),
+            conv.quantized_scale.data(), conv.bias.data(), conv.out_channels, oc, residual, relu, out);
+    }
+    for (; oc + 4 * VEC <= conv.out_channels; oc += 4 * VEC) {
+        conv3x3_int8_block<4>(in, conv.quantized_in_channels, conv.quantized_weight.data(),
+            conv.quantized_scale.data(), conv.bias.data(), conv.out_channels, oc, residual, relu, out);
+    }
+    for (; oc < conv.out_channels; oc += VEC) {
+        conv3x3_int8_block<1>(in, conv.quantized_in_channels, conv.quantized_weight.data(),
+            conv.quantized_scale.data(), conv.bias.data(), conv.out_channels, oc, residual, relu, out);
+    }
+}
+
+void NativeNet::conv1x1(const Conv& conv, const float* in, float* out) {
+    for (unsigned int c = 0; c < conv.out_channels; c++) {
+        const float* w = conv.weight.data() + c * conv.in_channels;
+        for (unsigned int i = 0; i < WIDTH; i++) {
+            for (unsigned int j = 0; j < WIDTH; j++) {
+                const float* src = in + ((i + 1) * PAD + j + 1) * conv.in_channels;
+                float sum = conv.bias[c] + dot(src, w, conv.in_channels);
+                out[(c * WIDTH + i) * WIDTH + j] = std::max(sum, 0.f);
+            }
+        }
+    }
+}
+
+void NativeNet::linear(const Linear& fc, const float* in, float* out) {
+    for (unsigned int i = 0; i < fc.out_features; i++) {
+        out[i] = fc.bias[i] + dot(fc.weight.data() + i * fc.in_features, in, fc.in_features);
+    }
+}
+
+void NativeNet::calibrate(const float* states, unsigned int count) {
+    // ranges of the float net
+    this->quantized = false;
+    Scratch scratch = this->make_scratch();
+    std::vector<float> ranges(2 * this->blocks.size(), 0.f);
+    std::vector<float> probs(ALL);
+    float value;
+
+    for (unsigned int i = 0; i < count; i++) {
+        this->forward_one(states + i * INPUT_PLANES * WIDTH * WIDTH, scratch, ranges.data(),
+            probs.data(), &value);
+    }
+    this->quantize(ranges);
+}
+
+void NativeNet::quantize(const std::vector<float>& ranges) {
+    // a dead activation gets any step, it is always zero
+    auto step = [](float range) { return range > 0 ? range / QUANTIZED_MAX : 1.f; };
+
+    for (unsigned int i = 0; i < this->blocks.size(); i++) {
+        auto& block = this->blocks[i];
+        quantize_conv(block.conv1, step(ranges[2 * i]));
+        if (block.downsample) {
+            quantize_conv(block.downsample_conv, step(ranges[2 * i]));
+        }
+        quantize_conv(block.conv2, step(ranges[2 * i + 1]));
+    }
+    this->ranges = ranges;
+    this->quantized = true;
+}
+
+void NativeNet::quantize_conv(Conv& conv, float input_scale) {
+    const unsigned int in_channels = round_up4(conv.in_channels);
+    const unsigned int out_channels = conv.out_channels;
+
+    conv.quantized_in_channels = in_channels;
+    conv.input_scale = input_scale;
+    conv.quantized_weight.assign(9 * in_channels * out_channels, 0);
+    conv.quantized_scale.resize(out_channels);
+
+    // symmetric, one step per output channel
+    for (unsigned int oc = 0; oc < out_channels; oc++) {
+        float range = 0;
+        for (unsigned int tap = 0; tap < 9; tap++) {
+            for (unsigned int ic = 0; ic < conv.in_channels; ic++) {
+                range = std::max(range, std::abs(conv.weight[(tap * conv.in_channels + ic) * out_channels + oc]));
+            }
+        }
+        float weight_scale = range > 0 ? range / QUANTIZED_MAX : 1.f;
+
+        for (unsigned int tap = 0; tap < 9; tap++) {
+            for (unsigned int ic = 0; ic < conv.in_channels; ic++) {
+                float w = conv.weight[(tap * conv.in_channels + ic) * out_channels + oc];
+                conv.quantized_weight[tap * in_channels * out_channels + ic / 4 * out_channels * 4 + oc * 4 + ic % 4] =
+                    int8_t(std::clamp(std::round(w / weight_scale), -QUANTIZED_MAX, QUANTIZED_MAX));
+            }
+        }
+        conv.quantized_scale[oc] = input_scale * weight_scale;
+    }
+}
+
+void NativeNet::save_calibration(const std::string& path) const {
+    if (this->ranges.empty()) {
+        throw std::runtime_error("native net is not calibrated");
+    }
+
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("can't open " + path);
+    }
+
+    // block count, then the two ranges of every block
+    out.precision(std::numeric_limits<float>::max_digits10);
+    out << this->blocks.size() << std::endl;
+    for (unsigned int i = 0; i < this->blocks.size(); i++) {
+        out << this->ranges[2 * i] << " " << this->ranges[2 * i + 1] << std::endl;
+    }
+}
+
+void NativeNet::load_calibration(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("can't open " + path);
+    }
+
+    size_t block_num = 0;
+    in >> block_num;
+    if (!in || block_num != this->blocks.size()) {
+        throw std::runtime_error(path + " doesn't match the native net");
+    }
+
+    std::vector<float> ranges(2 * block_num);
+    for (auto& range : ranges) {
+        in >> range;
+    }
+    if (!in) {
+        throw std::runtime_error("unexpected end of " + path);
+    }
+    this->quantize(ranges);
+}
+
+void NativeNet::set_quantized(bool quantized) {
+    if (quantized && this->ranges.empty()) {
+        throw std::runtime_error("native net is not calibrated");
+    }
+    this->quantized = quantized;
+}
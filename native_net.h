@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// cpu inference for the NeuralNetWork of py/net.py without libtorch, the
+// batch norms are folded into the convolutions by NeuralNetWorkWrapper.save_native
+//
+// activations are channels-last with a zero border, [WIDTH + 2][WIDTH + 2][channels],
+// so every 3x3 tap is a plain offset and the channels of a pixel are whole
+// vectors, the kernels use avx-512 or avx2 + fma when compiled for them
+//
+// the trunk can run in int8: weights per output channel, activations as
+// 7-bit unsigned with one scale per convolution input taken from calibration
+// positions, the heads stay in float
+class NativeNet {
+public:
+    explicit NativeNet(const std::string& path);  // a .native weight file
+    ~NativeNet();
+
+    // states: [batch, 3, WIDTH, WIDTH] as NeuralNetwork::encode_states,
+    // probs: [batch, ALL] after softmax, values: [batch]
+    // thread_num: threads the batch is split across, the caller is one of them
+    void forward(const float* states, unsigned int batch,
+        float* probs, float* values, unsigned int thread_num = 1) const;
+
+    static bool is_native_path(const std::string& path);  // ends with .native
+
+    // int8 trunk, scales from the largest activations seen on the positions,
+    // not thread-safe, do it before sharing the net
+    void calibrate(const float* states, unsigned int count);
+    void save_calibration(const std::string& path) const;
+    void load_calibration(const std::string& path);
+    void set_quantized(bool quantized);  // back to float and again, once calibrated
+    bool is_quantized() const { return this->quantized; }
+
+private:
+    struct Conv {
+        unsigned int in_channels;
+        unsigned int out_channels;
+        std::vector<float> weight;  // 3x3: [3][3][in][out], 1x1: [out][in]
+        std::vector<float> bias;    // folded batch norm
+
+        // int8, 3x3 only
+        unsigned int quantized_in_channels;  // in rounded up to 4
+        float input_scale;                   // activation step
+        std::vector<int8_t> quantized_weight;  // [3][3][in / 4][out][4]
+        std::vector<float> quantized_scale;    // input_scale times the weight step of every output
+    };
+
+    struct Linear {
+        unsigned int in_features;
+        unsigned int out_features;
+        std::vector<float> weight;  // [out][in]
+        std::vector<float> bias;
+    };
+
+    struct Block {
+        Conv conv1;
+        Conv conv2;
+        bool downsample;
+        Conv downsample_conv;
+    };
+
+    // padded activations, only the insides are written so the borders stay
+    // zero for a whole batch
+    struct Scratch {
+        std::vector<float> floats;
+        std::vector<uint8_t> bytes;
+        unsigned int channels = 0;  // trunk width it is laid out for
+    };
+    Scratch make_scratch() const;
+    Scratch& get_scratch() const;  // of the calling thread, kept across forwards
+
+    // ranges: largest input of every block and of its second convolution,
+    // updated when given
+    void forward_one(const float* state, Scratch& scratch, float* ranges,
+        float* probs, float* value) const;
+    size_t head_size() const;  // scratch floats for the heads
+
+    static void conv3x3(const Conv& conv, const float* in, const float* residual,
+        bool relu, float* out);
+    static void conv1x1(const Conv& conv, const float* in, float* out);  // out: [out][WIDTH][WIDTH], relu
+    static void linear(const Linear& fc, const float* in, float* out);
+    static void conv3x3_int8(const Conv& conv, const uint8_t* in, const float* residual,
+        bool relu, float* out);
+    static void quantize_conv(Conv& conv, float input_scale);
+    void quantize(const std::vector<float>& ranges);
+
+    static Conv read_conv(std::istream& in, unsigned int kernel);
+    static Linear read_linear(std::istream& in);
+
+    std::vector<Block> blocks;
+    unsigned int channels;  // trunk width
+
+    Conv p_conv;
+    Linear p_fc;
+    Conv v_conv;
+    Linear v_fc1;
+    Linear v_fc2;
+
+    bool quantized;
+    std::vector<float> ranges;  // calibrated, empty before
+
+    // helpers of a split forward, created by the first one
+    mutable std::unique_ptr<ThreadPool> pool;
+    mutable std::mutex pool_lock;
+};
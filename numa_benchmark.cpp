@@ -0,0 +1,96 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <numeric>
+#include <random>
+
+#include "MCTS.h"
+#include "cpu_scheduler.h"
+
+using namespace std;
+using namespace chrono;
+
+// tree-node sized cells linked in random order, every step is a cache miss
+struct Cell
+{
+	Cell* next;
+	char pad[sizeof(TreeNode) - sizeof(Cell*)];
+};
+
+const size_t CELL_NUM = (size_t(256) << 20) / sizeof(Cell);
+const size_t STEP_NUM = 1 << 24;
+
+volatile Cell* sink; // keeps the chase from being optimised away
+
+// allocate on one node (first touch), chase the pointers from another
+double chase_ns(unsigned int alloc_node, unsigned int run_node)
+{
+	auto& scheduler = CpuScheduler::get_instance();
+	Cell* cells = nullptr;
+
+	thread alloc([&]
+	{
+		scheduler.pin_current_thread(alloc_node);
+		cells = new Cell[CELL_NUM];
+
+		vector<size_t> order(CELL_NUM);
+		iota(order.begin(), order.end(), 0);
+		shuffle(order.begin() + 1, order.end(), mt19937_64(42));
+		for (size_t i = 0; i < CELL_NUM; i++)
+		{
+			cells[order[i]].next = &cells[order[(i + 1) % CELL_NUM]];
+		}
+	});
+	alloc.join();
+
+	double ns = 0;
+	thread run([&]
+	{
+		scheduler.pin_current_thread(run_node);
+
+		Cell* p = cells;
+		auto start = steady_clock::now();
+		for (size_t i = 0; i < STEP_NUM; i++)
+		{
+			p = p->next;
+		}
+		ns = duration<double, nano>(steady_clock::now() - start).count() / STEP_NUM;
+		sink = p;
+	});
+	run.join();
+
+	delete[] cells;
+	return ns;
+}
+
+int main()
+{
+	auto nodes = CpuScheduler::read_numa_nodes();
+	auto& scheduler = CpuScheduler::get_instance();
+	scheduler.configure(0, 1);
+
+	cout << nodes.size() << " numa node(s)" << endl;
+	for (unsigned int i = 0; i < nodes.size(); i++)
+	{
+		cout << "node " << i << ": " << nodes[i].size() << " cpus" << endl;
+	}
+
+	// rows: node the tree was built on, columns: node searching it
+	cout << "ns per node access" << endl;
+	for (unsigned int alloc_node = 0; alloc_node < nodes.size(); alloc_node++)
+	{
+		for (unsigned int run_node = 0; run_node < nodes.size(); run_node++)
+		{
+			cout << setw(10) << fixed << setprecision(1) << chase_ns(alloc_node, run_node);
+		}
+		cout << endl;
+	}
+
+	if (nodes.size() > 1)
+	{
+		cout << "cross-socket penalty: "
+			<< chase_ns(0, 1) / chase_ns(0, 0) << "x" << endl;
+	}
+}
@@ -14,6 +14,9 @@ using namespace chrono;
 
 random_device rd;
 
+// searched opening tree, warm-starts the first move when present
+const string OPENING_TREE_PATH = "./trees/opening.tree";
+
 void print(vector<double>& v)
 {
 	for (auto i = 0; i < v.size(); i++)
@@ -58,7 +61,8 @@ int best_choice(vector<double> prob)
 
 void play_game_against_human(int thread_num = 12, double c_puct = 5.0,
 	int simul_cnt = 1000, double virtual_loss = 0.6, int game_tot = 1,
-	int batch_size = 512, bool jws_first = true)
+	int batch_size = 512, bool jws_first = true, int think_ms = 10000,
+	bool ponder = true, long long max_tree_mb = 2048)
 {
 	NeuralNetwork net(string("./models/" + get_best_network() + ".pt"), true, batch_size);
 
@@ -66,18 +70,31 @@ void play_game_against_human(int thread_num = 12, double c_puct = 5.0,
 	{
 
 		MCTS mcts(&net, thread_num, c_puct, simul_cnt, virtual_loss, ALL);
+		mcts.set_memory_limit(max_tree_mb << 20); // bound the tree while pondering
+		mcts.early_stop = true; // give back the thinking time once the move is settled
 		GameField g;
-		int turn_id = 0;
+		if (ifstream(OPENING_TREE_PATH))
+		{
+			try
+			{
+				g = mcts.load_tree(OPENING_TREE_PATH);
+			}
+			catch (exception& e)
+			{
+				cout << "ignore opening tree: " << e.what() << endl;
+			}
+		}
+		// the side to move comes from the board, a loaded tree may start anywhere
+		int jws_color = jws_first ? black : white;
 
 		vector<double> move_probs;
 		auto final_move = PASS;
 
 		while (g.referee() == unfinished)
 		{
-			if ((turn_id % 2 == 0 && jws_first) ||
-				(turn_id % 2 != 0 && jws_first == false))
+			if (g.current_color == jws_color)
 			{
-				move_probs = mcts.get_action_probs(&g, 1);
+				move_probs = mcts.get_action_probs(&g, 1, simul_cnt, milliseconds(think_ms));
 				final_move = best_choice(move_probs);
 
 				print(move_probs);
@@ -86,9 +103,14 @@ void play_game_against_human(int thread_num = 12, double c_puct = 5.0,
 			}
 			else
 			{
+				// think on the human's time, the subtree is reused by update_with_move
+				if (ponder) mcts.start_ponder(&g);
+
 				cout << "HUMAN: ";
 				string human_move_str;
 				cin >> human_move_str;
+
+				if (ponder) mcts.stop_ponder();
 				final_move = str_to_act(human_move_str);
 			}
 
@@ -96,7 +118,6 @@ void play_game_against_human(int thread_num = 12, double c_puct = 5.0,
 			g.print();
 
 			mcts.update_with_move(final_move);
-			turn_id++;
 		}
 
 		int game_status = g.referee();
@@ -0,0 +1,7 @@
+from net import *
+import sys
+
+net = NeuralNetWorkWrapper(lr=0.001, l2=0.0001, num_layers=8, num_channels=64, n=8, action_size=65)
+if len(sys.argv) == 3:
+    net.load_model("../models", str(sys.argv[1]))
+    net.save_native("../models/" + str(sys.argv[2]) + ".native")
\ No newline at end of file
@@ -1,6 +1,7 @@
 import sys
 import os
 import random
+import struct
 
 import torch
 import torch.nn as nn
@@ -272,8 +273,60 @@ class NeuralNetWorkWrapper():
         traced_script_module = torch.jit.trace(self.neural_network, example)
         traced_script_module.save(filepath)
 
+        # weights for the native cpu engine
+        self.save_native(os.path.join(folder, filename) + '.native')
+
         if self.train_use_gpu:
             self.neural_network.cuda()
         else:
             self.neural_network.cpu()
 
+    def save_native(self, filepath):
+        """save weights for native_net.cpp, batch norms folded into the convolutions
+        """
+
+        def fold(conv, bn):
+            # conv weight [out, in, k, k] and bias of conv followed by bn
+            scale = bn.weight / torch.sqrt(bn.running_var + bn.eps)
+            weight = conv.weight * scale.view(-1, 1, 1, 1)
+            bias = bn.bias - bn.running_mean * scale
+            return weight, bias
+
+        def write_tensor(f, t):
+            f.write(t.detach().cpu().contiguous().float().numpy().astype('<f4').tobytes())
+
+        def write_conv3x3(f, conv, bn):
+            # [ky][kx][in][out], the output channels of a tap are contiguous
+            weight, bias = fold(conv, bn)
+            f.write(struct.pack('<II', weight.size(1), weight.size(0)))
+            write_tensor(f, weight.permute(2, 3, 1, 0))
+            write_tensor(f, bias)
+
+        def write_conv1x1(f, conv, bn):
+            weight, bias = fold(conv, bn)
+            f.write(struct.pack('<II', weight.size(1), weight.size(0)))
+            write_tensor(f, weight.view(weight.size(0), -1))
+            write_tensor(f, bias)
+
+        def write_linear(f, fc):
+            f.write(struct.pack('<II', fc.in_features, fc.out_features))
+            write_tensor(f, fc.weight)
+            write_tensor(f, fc.bias)
+
+        net = self.neural_network
+        with torch.no_grad(), open(filepath, 'wb') as f:
+            f.write(b'NATV')
+            f.write(struct.pack('<IIII', 1, len(net.res_layers), self.n, net.p_fc.out_features))
+
+            for block in net.res_layers:
+                write_conv3x3(f, block.conv1, block.bn1)
+                write_conv3x3(f, block.conv2, block.bn2)
+                f.write(struct.pack('<I', 1 if block.downsample else 0))
+                if block.downsample:
+                    write_conv3x3(f, block.downsample_conv, block.downsample_bn)
+
+            write_conv1x1(f, net.p_conv, net.p_bn)
+            write_linear(f, net.p_fc)
+            write_conv1x1(f, net.v_conv, net.v_bn)
+            write_linear(f, net.v_fc1)
+            write_linear(f, net.v_fc2)
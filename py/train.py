@@ -66,6 +66,14 @@ for path, dir_list, file_list in g:
         # print(path + '\\' + dir_name + '\\value.txt')
         search_value = np.loadtxt(path + '\\' + dir_name + '\\value.txt', dtype=np.float32)
         search_value = search_value.reshape((lines, 1))
+
+        # with playout cap randomisation not every turn is recorded, so the
+        # player to move is stored per line
+        player_path = path + '\\' + dir_name + '\\player.txt'
+        if os.path.exists(player_path):
+            player = np.loadtxt(player_path, dtype=np.int32).reshape(lines)
+        else:
+            player = np.array([BLACK if l % (2*WIDTH) <= (WIDTH - 1) else WHITE for l in range(lines)])
         
         for l in range(lines):
             # in
@@ -73,16 +81,10 @@ for path, dir_list, file_list in g:
             # prob
             y_prob[line_index] = prob[l]
             # win
-            if winner == BLACK:
-                if l % (2*WIDTH) <= (WIDTH - 1):
-                    y_win[line_index][0] = (1 + search_value[l][0]) / 2.0
-                else:
-                    y_win[line_index][0] = (-1 + search_value[l][0]) / 2.0
-            elif winner == WHITE:
-                if l % (2*WIDTH) <= (WIDTH - 1):
-                    y_win[line_index][0] = (-1 + search_value[l][0]) / 2.0
-                else:
-                    y_win[line_index][0] = (1 + search_value[l][0]) / 2.0   
+            if winner == player[l]:
+                y_win[line_index][0] = (1 + search_value[l][0]) / 2.0
+            else:
+                y_win[line_index][0] = (-1 + search_value[l][0]) / 2.0
 
             line_index += 1
 
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <string>
+#include <filesystem>
+
+#include "GameField.h"
+#include "MCTS.h"
+#include "libtorch.h"
+
+using namespace std;
+
+// search the initial position and save the tree for play_against_human
+//
+// usage: save_opening_tree <model.pt> [simulations] [tree path]
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		cout << "usage: save_opening_tree <model.pt> [simulations] [tree path]" << endl;
+		return 1;
+	}
+	string model_path = argv[1];
+	unsigned int simul_cnt = argc > 2 ? stoul(argv[2]) : 20000;
+	filesystem::path tree_path = argc > 3 ? argv[3] : "./trees/opening.tree";
+
+	try {
+		NeuralNetwork net(model_path, true, 64);
+
+		// the book keeps the network priors, searches on it add their own noise
+		MCTS mcts(&net, 12, 5, simul_cnt, 3, ALL);
+		mcts.use_noise = false;
+
+		GameField g;
+		mcts.get_action_probs(&g, 1);
+		cout << mcts.get_search_stats().to_string() << endl;
+
+		if (tree_path.has_parent_path())
+		{
+			filesystem::create_directories(tree_path.parent_path());
+		}
+		mcts.save_tree(tree_path.string(), &g);
+		cout << "saved " << tree_path.string() << endl;
+	}
+	catch (exception& e)
+	{
+		cout << e.what() << endl;
+		return 1;
+	}
+}
@@ -0,0 +1,459 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+
+#include <torch/script.h>
+
+#include "GameField.h"
+#include "native_net.h"
+
+using namespace std;
+using namespace chrono;
+
+// checks NativeNet against a plain NCHW forward of random weights written in
+// the layout of NeuralNetWorkWrapper.save_native, then its int8 trunk against
+// the float one
+//
+// usage: test_native_net [model.pt model.native]
+// with a pair exported from the same checkpoint, checks NativeNet against
+// the TorchScript module instead
+
+const unsigned int BLOCK_NUM = 8;
+const unsigned int CHANNELS = 64;
+const unsigned int STATE_SIZE = 3 * WIDTH * WIDTH;
+
+const double FLOAT_MAX_ERROR = 1e-4;
+const double INT8_MEAN_KL = 1e-2;
+const double INT8_TOP1 = 0.9;
+const double INT8_MEAN_VALUE_ERROR = 0.05;
+
+mt19937 rng(1);
+
+// weight [out][in][k][k] as in torch, bias after the folded batch norm
+struct Conv
+{
+	unsigned int in, out, kernel;
+	vector<float> weight, bias;
+};
+
+struct Linear
+{
+	unsigned int in, out;
+	vector<float> weight, bias;
+};
+
+Conv random_conv(unsigned int in, unsigned int out, unsigned int kernel)
+{
+	normal_distribution<float> normal(0, 1);
+	float scale = 1.0f / sqrt(float(in * kernel * kernel));
+
+	Conv conv{ in, out, kernel };
+	for (unsigned int i = 0; i < out * in * kernel * kernel; i++)
+	{
+		conv.weight.emplace_back(normal(rng) * scale);
+	}
+	for (unsigned int i = 0; i < out; i++)
+	{
+		conv.bias.emplace_back(normal(rng) * 0.1f);
+	}
+	return conv;
+}
+
+Linear random_linear(unsigned int in, unsigned int out)
+{
+	normal_distribution<float> normal(0, 1);
+	float scale = 1.0f / sqrt(float(in));
+
+	Linear fc{ in, out };
+	for (unsigned int i = 0; i < out * in; i++)
+	{
+		fc.weight.emplace_back(normal(rng) * scale);
+	}
+	for (unsigned int i = 0; i < out; i++)
+	{
+		fc.bias.emplace_back(normal(rng) * 0.1f);
+	}
+	return fc;
+}
+
+struct Net
+{
+	vector<Conv> conv1, conv2;
+	Conv downsample;  // first block only, 3 to CHANNELS
+	Conv p_conv, v_conv;
+	Linear p_fc, v_fc1, v_fc2;
+};
+
+Net random_net()
+{
+	Net net;
+	for (unsigned int i = 0; i < BLOCK_NUM; i++)
+	{
+		net.conv1.emplace_back(random_conv(i == 0 ? 3 : CHANNELS, CHANNELS, 3));
+		net.conv2.emplace_back(random_conv(CHANNELS, CHANNELS, 3));
+	}
+	net.downsample = random_conv(3, CHANNELS, 3);
+	net.p_conv = random_conv(CHANNELS, 4, 1);
+	net.p_fc = random_linear(4 * WIDTH * WIDTH, ALL);
+	net.v_conv = random_conv(CHANNELS, 2, 1);
+	net.v_fc1 = random_linear(2 * WIDTH * WIDTH, 256);
+	net.v_fc2 = random_linear(256, 1);
+	return net;
+}
+
+void write_u32(ofstream& out, uint32_t x)
+{
+	out.write(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+void write_floats(ofstream& out, const vector<float>& v)
+{
+	out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(float));
+}
+
+// save_native: 3x3 weights permuted to [ky][kx][in][out], 1x1 as [out][in]
+void write_conv(ofstream& out, const Conv& conv)
+{
+	write_u32(out, conv.in);
+	write_u32(out, conv.out);
+	if (conv.kernel == 3)
+	{
+		vector<float> permuted(conv.weight.size());
+		for (unsigned int o = 0; o < conv.out; o++)
+		{
+			for (unsigned int i = 0; i < conv.in; i++)
+			{
+				for (unsigned int k = 0; k < 9; k++)
+				{
+					permuted[(k * conv.in + i) * conv.out + o] = conv.weight[(o * conv.in + i) * 9 + k];
+				}
+			}
+		}
+		write_floats(out, permuted);
+	}
+	else
+	{
+		write_floats(out, conv.weight);
+	}
+	write_floats(out, conv.bias);
+}
+
+void write_linear(ofstream& out, const Linear& fc)
+{
+	write_u32(out, fc.in);
+	write_u32(out, fc.out);
+	write_floats(out, fc.weight);
+	write_floats(out, fc.bias);
+}
+
+void write_native(const string& path, const Net& net)
+{
+	ofstream out(path, ios::binary);
+	out.write("NATV", 4);
+	write_u32(out, 1);
+	write_u32(out, BLOCK_NUM);
+	write_u32(out, WIDTH);
+	write_u32(out, ALL);
+
+	for (unsigned int i = 0; i < BLOCK_NUM; i++)
+	{
+		write_conv(out, net.conv1[i]);
+		write_conv(out, net.conv2[i]);
+		write_u32(out, i == 0);
+		if (i == 0)
+		{
+			write_conv(out, net.downsample);
+		}
+	}
+	write_conv(out, net.p_conv);
+	write_linear(out, net.p_fc);
+	write_conv(out, net.v_conv);
+	write_linear(out, net.v_fc1);
+	write_linear(out, net.v_fc2);
+}
+
+// x: [in][WIDTH][WIDTH], zero padding
+vector<double> conv_nchw(const Conv& conv, const vector<double>& x)
+{
+	int pad = conv.kernel / 2;
+	vector<double> y(conv.out * WIDTH * WIDTH);
+	for (unsigned int o = 0; o < conv.out; o++)
+	{
+		for (int i = 0; i < WIDTH; i++)
+		{
+			for (int j = 0; j < WIDTH; j++)
+			{
+				double sum = conv.bias[o];
+				for (unsigned int c = 0; c < conv.in; c++)
+				{
+					for (unsigned int ky = 0; ky < conv.kernel; ky++)
+					{
+						for (unsigned int kx = 0; kx < conv.kernel; kx++)
+						{
+							int y0 = i + int(ky) - pad, x0 = j + int(kx) - pad;
+							if (y0 < 0 || y0 >= WIDTH || x0 < 0 || x0 >= WIDTH)
+							{
+								continue;
+							}
+							sum += conv.weight[((o * conv.in + c) * conv.kernel + ky) * conv.kernel + kx]
+								* x[(c * WIDTH + y0) * WIDTH + x0];
+						}
+					}
+				}
+				y[(o * WIDTH + i) * WIDTH + j] = sum;
+			}
+		}
+	}
+	return y;
+}
+
+vector<double> linear(const Linear& fc, const vector<double>& x)
+{
+	vector<double> y(fc.out);
+	for (unsigned int o = 0; o < fc.out; o++)
+	{
+		double sum = fc.bias[o];
+		for (unsigned int i = 0; i < fc.in; i++)
+		{
+			sum += fc.weight[o * fc.in + i] * x[i];
+		}
+		y[o] = sum;
+	}
+	return y;
+}
+
+void relu(vector<double>& x)
+{
+	for (auto& v : x)
+	{
+		v = max(v, 0.0);
+	}
+}
+
+// the forward of NeuralNetWork in py/net.py
+void reference_forward(const Net& net, const float* state, vector<double>& probs, double& value)
+{
+	vector<double> x(state, state + STATE_SIZE);
+	for (unsigned int i = 0; i < BLOCK_NUM; i++)
+	{
+		auto residual = i == 0 ? conv_nchw(net.downsample, x) : x;
+		auto out = conv_nchw(net.conv1[i], x);
+		relu(out);
+		out = conv_nchw(net.conv2[i], out);
+		for (size_t k = 0; k < out.size(); k++)
+		{
+			out[k] += residual[k];
+		}
+		relu(out);
+		x = out;
+	}
+
+	auto p = conv_nchw(net.p_conv, x);
+	relu(p);
+	auto logits = linear(net.p_fc, p);
+	double max_logit = *max_element(logits.begin(), logits.end());
+	double sum = 0;
+	for (auto& l : logits)
+	{
+		l = exp(l - max_logit);
+		sum += l;
+	}
+	probs.resize(ALL);
+	for (int a = 0; a < ALL; a++)
+	{
+		probs[a] = logits[a] / sum;
+	}
+
+	auto v = conv_nchw(net.v_conv, x);
+	relu(v);
+	auto hidden = linear(net.v_fc1, v);
+	relu(hidden);
+	value = tanh(linear(net.v_fc2, hidden)[0]);
+}
+
+// encoded like NeuralNetwork::encode_states: black, white, white to move
+vector<float> random_states(unsigned int count)
+{
+	vector<float> states(count * STATE_SIZE, 0);
+	for (unsigned int n = 0; n < count; n++)
+	{
+		float* state = &states[n * STATE_SIZE];
+		for (int i = 0; i < WIDTH * WIDTH; i++)
+		{
+			unsigned int stone = rng() % 3;
+			if (stone < 2)
+			{
+				state[stone * WIDTH * WIDTH + i] = 1;
+			}
+		}
+		fill(state + 2 * WIDTH * WIDTH, state + STATE_SIZE, float(rng() % 2));
+	}
+	return states;
+}
+
+double forward_us(const NativeNet& net, const vector<float>& states, vector<float>& probs, vector<float>& values)
+{
+	unsigned int count = unsigned(states.size() / STATE_SIZE);
+	probs.resize(count * ALL);
+	values.resize(count);
+
+	auto start = steady_clock::now();
+	net.forward(states.data(), count, probs.data(), values.data());
+	return duration<double, micro>(steady_clock::now() - start).count() / count;
+}
+
+bool check_float(const Net& reference, const NativeNet& net)
+{
+	auto states = random_states(16);
+	vector<float> probs, values;
+	forward_us(net, states, probs, values);
+
+	double max_error = 0;
+	for (unsigned int n = 0; n < 16; n++)
+	{
+		vector<double> expected_probs;
+		double expected_value;
+		reference_forward(reference, &states[n * STATE_SIZE], expected_probs, expected_value);
+
+		for (int a = 0; a < ALL; a++)
+		{
+			max_error = max(max_error, fabs(expected_probs[a] - probs[n * ALL + a]));
+		}
+		max_error = max(max_error, fabs(expected_value - values[n]));
+	}
+
+	cout << "float max error against nchw: " << max_error << endl;
+	return max_error < FLOAT_MAX_ERROR;
+}
+
+// a batch split across threads gives what one thread gives, position by position
+bool check_split(const NativeNet& net)
+{
+	auto states = random_states(37);
+	vector<float> probs, values;
+	forward_us(net, states, probs, values);
+
+	vector<float> split_probs(probs.size()), split_values(values.size());
+	net.forward(states.data(), 37, split_probs.data(), split_values.data(), 4);
+
+	bool same = split_probs == probs && split_values == values;
+	cout << "split batch: " << (same ? "same" : "different") << endl;
+	return same;
+}
+
+// calibrate on some positions, compare with float on the others, then
+// reload the calibration into a fresh net
+bool check_int8(NativeNet& net, const string& path)
+{
+	auto calibration = random_states(256);
+	auto held_out = random_states(256);
+
+	vector<float> float_probs, float_values, int8_probs, int8_values;
+	double float_us = forward_us(net, held_out, float_probs, float_values);
+	net.calibrate(calibration.data(), 256);
+	double int8_us = forward_us(net, held_out, int8_probs, int8_values);
+	net.set_quantized(false);
+
+	string calibration_path = path + ".calib";
+	net.save_calibration(calibration_path);
+	NativeNet loaded(path);
+	loaded.load_calibration(calibration_path);
+	filesystem::remove(calibration_path);
+
+	vector<float> loaded_probs, loaded_values;
+	forward_us(loaded, held_out, loaded_probs, loaded_values);
+	bool same = loaded_probs == int8_probs && loaded_values == int8_values;
+
+	double kl_sum = 0, value_sum = 0;
+	unsigned int top1 = 0;
+	for (unsigned int n = 0; n < 256; n++)
+	{
+		const float* p = &float_probs[n * ALL];
+		const float* q = &int8_probs[n * ALL];
+		for (int a = 0; a < ALL; a++)
+		{
+			if (p[a] > 0)
+			{
+				kl_sum += p[a] * log(p[a] / max(q[a], 1e-12f));
+			}
+		}
+		top1 += max_element(p, p + ALL) - p == max_element(q, q + ALL) - q;
+		value_sum += fabs(float_values[n] - int8_values[n]);
+	}
+
+	cout << "int8 policy kl: " << kl_sum / 256 << " top-1 agreement: " << top1 / 256.0
+		<< " value error: " << value_sum / 256 << endl;
+	cout << "us per position: float " << float_us << " int8 " << int8_us << endl;
+	cout << "reloaded calibration: " << (same ? "same" : "different") << endl;
+	return same && kl_sum / 256 < INT8_MEAN_KL && top1 / 256.0 > INT8_TOP1 &&
+		value_sum / 256 < INT8_MEAN_VALUE_ERROR;
+}
+
+// an exported pair of the same checkpoint has to agree
+bool check_torch(const string& module_path, const string& native_path)
+{
+	auto module = torch::jit::load(module_path);
+	module.eval();
+	NativeNet net(native_path);
+
+	const unsigned int count = 64;
+	auto states = random_states(count);
+	vector<float> probs, values;
+	forward_us(net, states, probs, values);
+
+	torch::Tensor input = torch::from_blob(states.data(), { count, 3, WIDTH, WIDTH }, torch::dtype(torch::kFloat32));
+	auto result = module.forward({ input }).toTuple();
+	torch::Tensor p_batch = result->elements()[0].toTensor().exp().toType(torch::kFloat32).to(at::kCPU);
+	torch::Tensor v_batch = result->elements()[1].toTensor().toType(torch::kFloat32).to(at::kCPU);
+	const float* p = p_batch.data_ptr<float>();
+	const float* v = v_batch.data_ptr<float>();
+
+	double max_error = 0;
+	for (unsigned int n = 0; n < count; n++)
+	{
+		for (int a = 0; a < ALL; a++)
+		{
+			max_error = max(max_error, double(fabs(p[n * ALL + a] - probs[n * ALL + a])));
+		}
+		max_error = max(max_error, double(fabs(v[n] - values[n])));
+	}
+
+	cout << "max error against " << module_path << ": " << max_error << endl;
+	return max_error < FLOAT_MAX_ERROR;
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		if (argc == 3)
+		{
+			bool ok = check_torch(argv[1], argv[2]);
+			cout << (ok ? "ok" : "failed") << endl;
+			return ok ? 0 : 1;
+		}
+
+		auto reference = random_net();
+		string path = (filesystem::temp_directory_path() / "test_native_net.native").string();
+		write_native(path, reference);
+		NativeNet net(path);
+
+		bool float_ok = check_float(reference, net) && check_split(net);
+		bool int8_ok = check_int8(net, path);
+		filesystem::remove(path);
+		cout << "float: " << (float_ok ? "ok" : "failed") << endl;
+		cout << "int8: " << (int8_ok ? "ok" : "failed") << endl;
+		return float_ok && int8_ok ? 0 : 1;
+	}
+	catch (exception& e)
+	{
+		cout << e.what() << endl;
+		return 1;
+	}
+}
@@ -15,6 +15,51 @@
 using namespace std;
 using namespace chrono;
 
+// the private trees of a root-parallel search count against the memory cap,
+// pruning has to bring the whole search back under it
+bool check_root_parallel_memory_limit(NeuralNetwork* net)
+{
+	MCTS mcts(net, 4, 5, 400, 3, 65);
+	mcts.root_parallel = true;
+	mcts.set_memory_limit(mcts.get_node_bytes() * 3000);
+
+	GameField g;
+	for (int i = 0; i < 4; i++)
+	{
+		mcts.get_action_probs(&g, 1);
+		mcts.prune_tree();
+		if (mcts.tree_full())
+		{
+			cout << "tree still full after search " << i << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// gathering several leaves per descent must still spend exactly the budget,
+// whatever the collisions between the search threads
+bool check_gather_budget(NeuralNetwork* net)
+{
+	for (unsigned int gather_size : { 4u, 8u })
+	{
+		MCTS mcts(net, 4, 5, 64, 3, 65);
+		mcts.gather_size = gather_size;
+
+		// the first search also expands the root
+		GameField g;
+		mcts.get_action_probs(&g, 1);
+		mcts.get_action_probs(&g, 1);
+		unsigned int sims = mcts.get_search_stats().simulations;
+		if (sims != 64)
+		{
+			cout << "gather " << gather_size << " ran " << sims << " of 64 sims" << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
 int main()
 {
 	try {
@@ -57,6 +102,11 @@ int main()
 		{
 			cout << i << endl;
 		}
+
+		cout << "root parallel memory limit: "
+			<< (check_root_parallel_memory_limit(&net) ? "ok" : "failed") << endl;
+		cout << "gather budget: "
+			<< (check_gather_budget(&net) ? "ok" : "failed") << endl;
 	}
 	catch (exception& e)
 	{
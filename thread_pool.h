@@ -1,47 +1,244 @@
 #pragma once
 
 #include <vector>
-#include <queue>
+#include <memory>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <condition_variable>
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <cstdint>
+#include <latch>
+#include <algorithm>
+#include <exception>
+
+// chase-lev deque, the owner pushes and pops at the bottom, thieves steal
+// from the top
+template <class T>
+class WorkStealingDeque {
+public:
+    inline WorkStealingDeque(long long capacity = 256)
+        : top(0), bottom(0) {
+        this->arrays.emplace_back(new Array(capacity));
+        this->array.store(this->arrays.back().get());
+    }
+
+    // owner only
+    inline void push(T x) {
+        long long b = this->bottom.load(std::memory_order_relaxed);
+        long long t = this->top.load(std::memory_order_acquire);
+        Array* a = this->array.load(std::memory_order_relaxed);
+
+        if (b - t > a->capacity - 1) {
+            a = this->grow(a, b, t);
+        }
+
+        a->put(b, x);
+        std::atomic_thread_fence(std::memory_order_release);
+        this->bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // owner only, returns nullptr when empty
+    inline T pop() {
+        long long b = this->bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = this->array.load(std::memory_order_relaxed);
+        this->bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = this->top.load(std::memory_order_relaxed);
+
+        T x = nullptr;
+        if (t <= b) {
+            x = a->get(b);
+            if (t == b) {
+                // last element, race the thieves for it
+                if (!this->top.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    x = nullptr;
+                }
+                this->bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        }
+        else {
+            this->bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    // any thread, returns nullptr when empty or lost the race
+    inline T steal() {
+        long long t = this->top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = this->bottom.load(std::memory_order_acquire);
+
+        if (t < b) {
+            Array* a = this->array.load(std::memory_order_acquire);
+            T x = a->get(t);
+            if (!this->top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return x;
+        }
+        return nullptr;
+    }
+
+private:
+    struct Array {
+        long long capacity;
+        std::unique_ptr<std::atomic<T>[]> buffer;
+
+        Array(long long capacity)
+            : capacity(capacity), buffer(new std::atomic<T>[capacity]) {}
+
+        T get(long long i) const {
+            return this->buffer[i & (this->capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void put(long long i, T x) {
+            this->buffer[i & (this->capacity - 1)].store(x, std::memory_order_relaxed);
+        }
+    };
+
+    inline Array* grow(Array* a, long long b, long long t) {
+        // thieves may still read the old array, it is freed with the deque
+        Array* bigger = new Array(a->capacity * 2);
+        for (long long i = t; i < b; i++) {
+            bigger->put(i, a->get(i));
+        }
+        this->arrays.emplace_back(bigger);
+        this->array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    std::atomic<long long> top;
+    std::atomic<long long> bottom;
+    std::atomic<Array*> array;
+    std::vector<std::unique_ptr<Array>> arrays;  // owner only
+};
+
+// bounded lock-free queue for tasks committed from outside the pool
+template <class T>
+class InjectionQueue {
+public:
+    inline InjectionQueue(size_t capacity = 1024)
+        : capacity(capacity), cells(new Cell[capacity]), head(0), tail(0) {
+        for (size_t i = 0; i < capacity; i++) {
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    inline bool push(T x) {
+        size_t pos = this->tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = this->cells[pos & (this->capacity - 1)];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+            if (diff == 0) {
+                if (this->tail.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed)) {
+                    cell.data = x;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;  // full
+            }
+            else {
+                pos = this->tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    inline T pop() {
+        size_t pos = this->head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = this->cells[pos & (this->capacity - 1)];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+
+            if (diff == 0) {
+                if (this->head.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed)) {
+                    T x = cell.data;
+                    cell.sequence.store(pos + this->capacity, std::memory_order_release);
+                    return x;
+                }
+            }
+            else if (diff < 0) {
+                return nullptr;  // empty
+            }
+            else {
+                pos = this->head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    size_t capacity;  // power of two
+    std::unique_ptr<Cell[]> cells;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
 
 class ThreadPool {
 public:
     using task_type = std::function<void()>;
 
-    inline ThreadPool(unsigned short thread_num = 4) {
+    // on_start runs first on every worker with its index, e.g. to pin it
+    inline ThreadPool(unsigned short thread_num = 4,
+        std::function<void(unsigned int)> on_start = nullptr) {
         this->run.store(true);
         this->idl_thread_num = thread_num;
+        this->pending.store(0);
+        this->sleeping.store(0);
+
+        for (unsigned int i = 0; i < thread_num; ++i) {
+            this->deques.emplace_back(new WorkStealingDeque<task_type*>());
+        }
 
         for (unsigned int i = 0; i < thread_num; ++i) {
             // thread type implicit conversion
-            pool.emplace_back([this] {
-                while (this->run) {
-                    std::function<void()> task;
+            pool.emplace_back([this, i, on_start] {
+                current_pool() = this;
+                current_index() = i;
+                if (on_start)
+                    on_start(i);
 
-                    // get a task
-                    {
+                while (true) {
+                    task_type* task = this->find_task(i);
+
+                    // spin a while before parking
+                    for (unsigned int spin = 0; task == nullptr && spin < SPIN_COUNT; spin++) {
+                        std::this_thread::yield();
+                        task = this->find_task(i);
+                    }
+
+                    if (task == nullptr) {
                         std::unique_lock<std::mutex> lock(this->lock);
+                        this->sleeping++;
                         this->cv.wait(lock, [this] {
-                            return this->tasks.size() > 0 || !this->run.load();
+                            return this->pending.load() > 0 || !this->run.load();
                         });
+                        this->sleeping--;
 
                         // exit
-                        if (!this->run.load() && this->tasks.empty())
+                        if (!this->run.load() && this->pending.load() == 0)
                             return;
-
-                        // pop task
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
+                        continue;
                     }
 
                     // run a task
                     this->idl_thread_num--;
-                    task();
+                    (*task)();
+                    delete task;
                     this->idl_thread_num++;
                 }
             });
@@ -50,7 +247,10 @@ public:
 
     inline ~ThreadPool() {
         // clean thread pool
-        this->run.store(false);
+        {
+            std::lock_guard<std::mutex> lock(this->lock);
+            this->run.store(false);
+        }
         this->cv.notify_all(); // wake all thread
 
         for (std::thread& thread : pool) {
@@ -73,26 +273,122 @@ public:
         // packaged_task package the bind function and future
         auto task_ptr = std::make_shared<std::packaged_task<return_type()>>(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        auto future = task_ptr->get_future();
 
-        {
-            std::lock_guard<std::mutex> lock(this->lock);
-            tasks.emplace([task_ptr] () { (*task_ptr)(); });
+        this->push(new task_type([task_ptr] () { (*task_ptr)(); }));
+
+        return future;
+    }
+
+    template <class F>
+    void parallel_for(size_t n, F&& fn) {
+        // call fn(i) for i in [0, n), the caller helps and returns when all are done
+        // example: .parallel_for(800, [&] (size_t i) { simulate(); });
+
+        if (n == 0)
+            return;
+        if (!this->run.load())
+            throw std::runtime_error("parallel_for on ThreadPool is stopped.");
+
+        // one counter and one latch for the whole batch, shared with helpers
+        // that may only start once the batch is over
+        struct batch_type {
+            std::function<void(size_t)> fn;
+            size_t n;
+            std::atomic<size_t> next;
+            std::latch done;
+            std::atomic<bool> failed;
+            std::exception_ptr error;
+
+            batch_type(std::function<void(size_t)> fn, size_t n)
+                : fn(std::move(fn)), n(n), next(0), done(n), failed(false) {}
+
+            void run() {
+                for (size_t i = this->next++; i < this->n; i = this->next++) {
+                    try {
+                        this->fn(i);
+                    }
+                    catch (...) {
+                        if (!this->failed.exchange(true))
+                            this->error = std::current_exception();
+                    }
+                    this->done.count_down();
+                }
+            }
+        };
+        auto batch = std::make_shared<batch_type>(std::forward<F>(fn), n);
+
+        size_t helpers = std::min(n - 1, this->pool.size());
+        for (size_t i = 0; i < helpers; i++) {
+            this->push(new task_type([batch] () { batch->run(); }));
         }
 
-        // wake a thread
-        this->cv.notify_one();
+        batch->run();
+        batch->done.wait();
 
-        return task_ptr->get_future();
+        if (batch->failed.load())
+            std::rethrow_exception(batch->error);
     }
 
     inline int get_idl_num() { return this->idl_thread_num; }
+    inline size_t get_thread_num() { return this->pool.size(); }
 
 private:
+    static const unsigned int SPIN_COUNT = 64;
+
+    inline void push(task_type* task) {
+        // a worker keeps its own tasks, others go through the injection queue
+        if (current_pool() == this) {
+            this->deques[current_index()]->push(task);
+        }
+        else {
+            while (!this->injected.push(task)) {
+                std::this_thread::yield();
+            }
+        }
+
+        // wake a thread only if one is parked
+        this->pending++;
+        if (this->sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock(this->lock);
+            this->cv.notify_one();
+        }
+    }
+
+    inline task_type* find_task(unsigned int index) {
+        // own deque, then the injection queue, then steal from the others
+        task_type* task = this->deques[index]->pop();
+        if (task == nullptr) {
+            task = this->injected.pop();
+        }
+        for (size_t i = 1; task == nullptr && i < this->deques.size(); i++) {
+            task = this->deques[(index + i) % this->deques.size()]->steal();
+        }
+
+        if (task != nullptr) {
+            this->pending--;
+        }
+        return task;
+    }
+
+    // the pool and deque the calling thread works for
+    static inline ThreadPool*& current_pool() {
+        static thread_local ThreadPool* pool = nullptr;
+        return pool;
+    }
+    static inline unsigned int& current_index() {
+        static thread_local unsigned int index = 0;
+        return index;
+    }
+
     std::vector<std::thread> pool; // thead pool
-    std::queue<task_type> tasks;   // tasks queue
-    std::mutex lock;               // lock for tasks queue
-    std::condition_variable cv;    // condition variable for tasks queue
+    std::vector<std::unique_ptr<WorkStealingDeque<task_type*>>> deques; // per-worker tasks
+    InjectionQueue<task_type*> injected; // tasks from outside the pool
+    std::mutex lock;               // lock for parking
+    std::condition_variable cv;    // condition variable for parked threads
 
     std::atomic<bool> run;                    // is running
     std::atomic<unsigned int> idl_thread_num; // idle thread number
+    std::atomic<long long> pending;           // tasks not taken yet
+    std::atomic<unsigned int> sleeping;       // parked threads
 };
@@ -8,6 +8,7 @@
 #include "GameField.h"
 #include "MCTS.h"
 #include "libtorch.h"
+#include "cpu_scheduler.h"
 
 using namespace std;
 using namespace chrono;
@@ -24,16 +25,43 @@ const int SELFPLAY_RANDOM_TURN = 8;
 const int THREAD_NUM = 12;
 const double VIRTUAL_LOSS = 3;
 const int SELFPLAY_SIMUL_NUM = 800;
+const int GATHER_SIZE = 4;
+const int SELFPLAY_SHARED_LEAVES = 512; // coroutine leaves in flight over all games, fill a batch
+
+const bool SELFPLAY_USE_GUMBEL = false;
+const int GUMBEL_SIMUL_NUM = 32;
+const int GUMBEL_CONSIDERED_NUM = 16;
+
+// playout cap randomisation
+const double SELFPLAY_FULL_SEARCH_PROB = 0.25;
+const int SELFPLAY_FAST_SIMUL_NUM = 100;
+const int GUMBEL_FAST_SIMUL_NUM = 8;
 
 const double CONTEST_CPUCT = 3.0;
 const int CONTEST_RANDOM_TURN = 12;
 const int CONTEST_SIMUL_NUM = 200;
 const int CONTEST_GAME_NUM = 2400;
+const bool CONTEST_ROOT_PARALLEL = false; // private tree per search thread
+const int CONTEST_COROUTINE_LEAVES = 0; // > 0: coroutine search with this many leaves in flight
+static_assert(!CONTEST_ROOT_PARALLEL || CONTEST_COROUTINE_LEAVES == 0,
+	"coroutine search runs on the shared tree");
 
 const double NET_PASS_THRESHOLD = 0.55;
 
 const int REMOVE_GAME_CNT = 12 * 8;
 
+const bool PRINT_SEARCH_STATS = false; // dump search statistics every move
+
+// one core budget for all search pools and libtorch, 0 = all cores
+const int CPU_CORE_BUDGET = 0;
+const int TORCH_THREAD_NUM = 4;
+const bool CPU_PIN_CORES = false; // one core per search thread, else its numa node
+const int INFER_WORKER_NUM = 1; // infer threads per self-play network, the torch threads are split
+const bool INFER_REPLICAS = false; // a module copy per infer thread
+const bool SELFPLAY_NATIVE_NET = false; // self-play on the cpu engine with models/*.native
+const bool SELFPLAY_INT8 = false; // int8 trunk with models/*.calib from int8_report, needs the native net
+const bool SELFPLAY_FOLLOW_BEST = true; // shared self-play swaps to a new index/best.txt between batches
+
 void print(vector<double>& v)
 {
 	for (auto i = 0; i < v.size(); i++)
@@ -114,6 +142,13 @@ int random_choice(vector<int> sample, vector<double> prob)
 	return sample[d(rng)];
 }
 
+bool random_bool(double prob)
+{
+	std::bernoulli_distribution d(prob);
+	std::default_random_engine rng{ rd() };
+	return d(rng);
+}
+
 int best_choice(vector<double> prob)
 {
 	auto x = std::distance(prob.begin(), max_element(prob.begin(), prob.end()));
@@ -281,41 +316,59 @@ void delete_randomly(string path, int delete_cnt)
 	//}
 }
 
-void self_play_games(int thread_num = 12, double c_puct = 3.0,
-	int simul_cnt = 1000, double virtual_loss = 0.6, int game_tot = 1,
-	int random_turn = 6, int batch_size = BATCH_SIZE)
+void self_play_one_game(NeuralNetwork* net, int thread_num, double c_puct,
+	int simul_cnt, double virtual_loss, int random_turn, int coroutine_leaves, bool use_gumbel,
+	int fast_simul_cnt = 0, double full_search_prob = 1.0)
 {
-	NeuralNetwork net(string("./models/" + get_best_network() + ".pt"), true, batch_size);
+	vector<GameField> gameFields(Rotate::RotateNum, GameField());
 
-	for (int game_cnt = 1; game_cnt <= game_tot; game_cnt++)
-	{
-		vector<GameField> gameFields(Rotate::RotateNum, GameField());
+	auto game_directory = get_random_directory();
+	system((string("mkdir .\\games\\") + game_directory).c_str());
 
-		auto game_directory = get_random_directory();
-		system((string("mkdir .\\games\\") + game_directory).c_str());
+	MCTS mcts(net, thread_num, c_puct, simul_cnt, virtual_loss, ALL);
+	mcts.coroutine_leaves = coroutine_leaves;
+	GameField g;
+	int turn_id = 0;
+	int record_cnt = 0;
 
-		MCTS mcts(&net, thread_num, c_puct, simul_cnt, virtual_loss, ALL);
-		GameField g;
-		int turn_id = 0;
+	vector<vector<double>> inputs;
+	vector<double> value;
+	vector<vector<double>> probs;
+	vector<int> player;
 
-		vector<vector<double>> inputs;
-		vector<double> value;
-		vector<vector<double>> probs;
+	// play a game
+	while (g.referee() == unfinished)
+	{
+		// playout cap randomisation, only full searches become training targets
+		bool full_search = random_bool(full_search_prob);
+		int search_cnt = full_search ? simul_cnt : fast_simul_cnt;
+		mcts.use_noise = full_search;
 
-		// play a game
-		while (g.referee() == unfinished)
+		// inputs
+		if (full_search)
 		{
-			// inputs
 			for (int rotate_index = 0; rotate_index < Rotate::RotateNum; rotate_index++)
 			{
 				auto rotated_inputs = gameFields[rotate_index].get_gamefield_mat();
 				inputs.emplace_back(rotated_inputs);
 			}
+		}
+
+		// get final move
+		vector<double> move_probs;
+		auto final_move = PASS;
 
-			// get final move
-			auto move_probs = mcts.get_action_probs(&g, 1);
+		if (use_gumbel)
+		{
+			// the gumbel noise already explores, the improved policy is the target
+			auto gumbel_result = mcts.get_gumbel_action_probs(&g, search_cnt, GUMBEL_CONSIDERED_NUM);
+			final_move = gumbel_result.first;
+			move_probs = gumbel_result.second;
+		}
+		else
+		{
+			move_probs = mcts.get_action_probs(&g, 1, search_cnt, milliseconds(0));
 
-			auto final_move = PASS;
 			if (turn_id < random_turn)
 			{
 				vector<int> all_moves(ALL, PASS);
@@ -331,26 +384,19 @@ void self_play_games(int thread_num = 12, double c_puct = 3.0,
 			{
 				final_move = best_choice(move_probs);
 			}
-			//cout << "------------" << turn_id << "------------" << endl;
-			//print(move_probs);
-			//cout << (g.current_color == black ? "black" : "white") << " play " << act_to_str(final_move) << endl;
-			//cout << "value: " << -mcts.root->q_sa << endl;
-
-			// host game field
-			g.play(final_move);
-
-			// rotated game fields play
-			for (int rotate_index = 0; rotate_index < Rotate::RotateNum; rotate_index++)
-			{
-				auto rotated_move = Rotate::get_new_pos_act(final_move, rotate_index);
-				//cout << "rotated move: " << rotated_move << " " << act_to_str(rotated_move) << endl;
-
-				gameFields[rotate_index].play(rotated_move);
-				//gameFields[rotate_index].print();
-			}
-
-			//cout << "1" << endl;
+		}
+		if (PRINT_SEARCH_STATS)
+		{
+			cout << mcts.get_search_stats().to_string() << endl;
+		}
+		//cout << "------------" << turn_id << "------------" << endl;
+		//print(move_probs);
+		//cout << (g.current_color == black ? "black" : "white") << " play " << act_to_str(final_move) << endl;
+		//cout << "value: " << -mcts.root->q_sa << endl;
 
+		// insert content
+		if (full_search)
+		{
 			// rotated act probs
 			for (int rotate_index = 0; rotate_index < Rotate::RotateNum; rotate_index++)
 			{
@@ -358,30 +404,127 @@ void self_play_games(int thread_num = 12, double c_puct = 3.0,
 				probs.emplace_back(rotated_probs);
 			}
 
-			//g.print();
-
-			// insert content
 			value.insert(value.end(), Rotate::RotateNum, -mcts.root->q_sa);
+			player.insert(player.end(), Rotate::RotateNum, g.current_color);
+			record_cnt++;
+		}
 
-			// mcts move
-			mcts.update_with_move(final_move);
-			turn_id++;
+		// host game field
+		g.play(final_move);
+
+		// rotated game fields play
+		for (int rotate_index = 0; rotate_index < Rotate::RotateNum; rotate_index++)
+		{
+			auto rotated_move = Rotate::get_new_pos_act(final_move, rotate_index);
+			//cout << "rotated move: " << rotated_move << " " << act_to_str(rotated_move) << endl;
+
+			gameFields[rotate_index].play(rotated_move);
+			//gameFields[rotate_index].print();
 		}
 
-		int game_status = g.referee();
-		//cout << (game_status == black ? "black win" : "white win") << endl;
+		//cout << "1" << endl;
+
+		//g.print();
 
-		write_file(value, (string("./games/") + game_directory + "/value.txt"));
-		write_file(game_status, (string("./games/") + game_directory + "/winner.txt"));
-		write_file(turn_id * 8, (string("./games/") + game_directory + "/length.txt"));
-		write_file(inputs, (string("./games/") + game_directory + "/in.txt"));
-		write_file(probs, (string("./games/") + game_directory + "/prob.txt"));
+		// mcts move
+		mcts.update_with_move(final_move);
+		turn_id++;
 	}
+
+	int game_status = g.referee();
+	//cout << (game_status == black ? "black win" : "white win") << endl;
+
+	write_file(value, (string("./games/") + game_directory + "/value.txt"));
+	write_file(game_status, (string("./games/") + game_directory + "/winner.txt"));
+	write_file(record_cnt * 8, (string("./games/") + game_directory + "/length.txt"));
+	write_file(inputs, (string("./games/") + game_directory + "/in.txt"));
+	write_file(probs, (string("./games/") + game_directory + "/prob.txt"));
+	write_file(player, (string("./games/") + game_directory + "/player.txt"));
 }
 
-void self_play_by_thread(int game_cnt)
+// all games feed one network, the search threads of the scheduler play them
+// one after another, each game keeps its share of the leaves in flight
+void self_play_games_shared(int game_tot, int leaves = SELFPLAY_SHARED_LEAVES,
+	int batch_size = BATCH_SIZE)
 {
-	self_play_games(THREAD_NUM, SELFPLAY_CPUCT, SELFPLAY_SIMUL_NUM, VIRTUAL_LOSS, game_cnt, SELFPLAY_RANDOM_TURN);
+	NeuralNetwork net(string("./models/" + get_best_network() + (SELFPLAY_NATIVE_NET ? ".native" : ".pt")),
+		true, batch_size, INFER_WORKER_NUM, INFER_REPLICAS);
+	if (SELFPLAY_NATIVE_NET && SELFPLAY_INT8)
+	{
+		net.load_calibration("./models/" + get_best_network() + ".calib");
+	}
+
+	// searches run inline on the pool threads, the trees stay on their node
+	auto pools = CpuScheduler::get_instance().get_search_pools(net.numa_node);
+	int worker_num = 0;
+	for (auto pool : pools)
+	{
+		worker_num += pool->get_thread_num();
+	}
+	int game_leaves = max(1, (leaves + worker_num - 1) / worker_num);
+
+	atomic<int> game_left(game_tot);
+	vector<future<void>> workers;
+	for (auto pool : pools)
+	{
+		for (size_t i = 0; i < pool->get_thread_num(); i++)
+		{
+			workers.emplace_back(pool->commit([&net, &game_left, game_leaves] {
+				while (game_left-- > 0)
+				{
+					self_play_one_game(&net, 0, SELFPLAY_CPUCT,
+						SELFPLAY_USE_GUMBEL ? GUMBEL_SIMUL_NUM : SELFPLAY_SIMUL_NUM, VIRTUAL_LOSS,
+						SELFPLAY_RANDOM_TURN, game_leaves, SELFPLAY_USE_GUMBEL,
+						SELFPLAY_USE_GUMBEL ? GUMBEL_FAST_SIMUL_NUM : SELFPLAY_FAST_SIMUL_NUM,
+						SELFPLAY_FULL_SEARCH_PROB);
+				}
+			}));
+		}
+	}
+	auto playing = [&workers] {
+		for (auto& worker : workers)
+		{
+			if (worker.wait_for(chrono::seconds(0)) != future_status::ready)
+			{
+				return true;
+			}
+		}
+		return false;
+	};
+
+	// searches keep running while the network changes under them, best only
+	// moves once a swap went through, a failed load is retried
+	string best = get_best_network();
+	string swapping_to;
+	future<bool> swapped;
+	while (SELFPLAY_FOLLOW_BEST && playing())
+	{
+		this_thread::sleep_for(chrono::seconds(1));
+		if (swapped.valid())
+		{
+			if (swapped.wait_for(chrono::seconds(0)) != future_status::ready)
+			{
+				continue;
+			}
+			if (swapped.get())
+			{
+				best = swapping_to;
+			}
+		}
+
+		string newest_best = get_best_network();
+		if (!newest_best.empty() && newest_best != best)
+		{
+			swapping_to = newest_best;
+			swapped = net.swap_model("./models/" + swapping_to + (SELFPLAY_NATIVE_NET ? ".native" : ".pt"),
+				SELFPLAY_NATIVE_NET && SELFPLAY_INT8 ? "./models/" + swapping_to + ".calib" : "");
+		}
+	}
+	for (auto& worker : workers)
+	{
+		worker.get();
+	}
+	if (PRINT_SEARCH_STATS) cout << net.get_batch_stats().to_string() << endl;
 }
 
 int hold_contest_between_nets(string old_net_index, string new_net_index, int game_num, int batch_size = BATCH_SIZE)
@@ -396,6 +539,15 @@ int hold_contest_between_nets(string old_net_index, string new_net_index, int ga
 
 		MCTS old_tree(&old_net, THREAD_NUM, CONTEST_CPUCT, CONTEST_SIMUL_NUM, VIRTUAL_LOSS, ALL);
 		MCTS new_tree(&new_net, THREAD_NUM, CONTEST_CPUCT, CONTEST_SIMUL_NUM, VIRTUAL_LOSS, ALL);
+		// coroutine search keeps its own leaves in flight, one per descent
+		old_tree.gather_size = CONTEST_COROUTINE_LEAVES > 0 ? 1 : GATHER_SIZE;
+		new_tree.gather_size = CONTEST_COROUTINE_LEAVES > 0 ? 1 : GATHER_SIZE;
+		old_tree.root_parallel = CONTEST_ROOT_PARALLEL;
+		new_tree.root_parallel = CONTEST_ROOT_PARALLEL;
+		old_tree.coroutine_leaves = CONTEST_COROUTINE_LEAVES;
+		new_tree.coroutine_leaves = CONTEST_COROUTINE_LEAVES;
+		old_tree.early_stop = true; // contest games are not training data
+		new_tree.early_stop = true;
 
 		GameField g;
 		int turn_id = 0;
@@ -408,10 +560,12 @@ int hold_contest_between_nets(string old_net_index, string new_net_index, int ga
 				(turn_id % 2 == 1 && !old_net_first))
 			{
 				move_probs = old_tree.get_action_probs(&g, 1);
+				if (PRINT_SEARCH_STATS) cout << "old " << old_tree.get_search_stats().to_string() << endl;
 			}
 			else
 			{
 				move_probs = new_tree.get_action_probs(&g, 1);
+				if (PRINT_SEARCH_STATS) cout << "new " << new_tree.get_search_stats().to_string() << endl;
 			}
 
 			if (turn_id < CONTEST_RANDOM_TURN)
@@ -445,46 +599,23 @@ int hold_contest_between_nets(string old_net_index, string new_net_index, int ga
 	return win_cnt;
 }
 
-void net_contest_by_thread(string old_net_index, string new_net_index, int game_num, shared_ptr<promise<int>> win_cnt, int batch_size = BATCH_SIZE)
-{
-	win_cnt->set_value(hold_contest_between_nets(old_net_index, new_net_index, game_num, batch_size));
-}
-
+// the contests run on the search pool threads, the threads they search with
 double get_winning_rate_multi_thread(string best, string newest)
 {
 	int sum = 0;
 	int contest_num_per_thread = CONTEST_GAME_NUM / (THREAD_NUM / 2);
 
-	vector<shared_ptr<promise<int>>> win_cnt_promises;
 	vector<future<int>> win_cnt_ftrs;
-	vector<thread> thread_vector;
-
 	for (int i = 0; i < (THREAD_NUM / 2); i++)
 	{
-		auto finished_promise = std::make_shared<std::promise<int>>();
-		win_cnt_promises.emplace_back(finished_promise);
-
-		win_cnt_ftrs.emplace_back(finished_promise->get_future());
-		thread_vector.emplace_back(
-			std::move(
-				std::thread(
-					net_contest_by_thread, best, newest, contest_num_per_thread, finished_promise, BATCH_SIZE
-				)
-			)
-		);
-	}
-	for (auto& ftr: win_cnt_ftrs)
-	{
-		ftr.wait();
+		auto pool = CpuScheduler::get_instance().get_search_pool(i);
+		win_cnt_ftrs.emplace_back(pool->commit(
+			hold_contest_between_nets, best, newest, contest_num_per_thread, BATCH_SIZE));
 	}
 	for (auto& ftr : win_cnt_ftrs)
 	{
 		sum += ftr.get();
 	}
-	for (auto& th : thread_vector)
-	{
-		th.join();
-	}
 	cout << "win: " << sum << endl;
 	return 1.0 * sum / CONTEST_GAME_NUM;
 }
@@ -506,16 +637,7 @@ void train(int game_tot = GAME_PER_TRAIN, int epoch_tot = ITERATION_NUM, int rem
 		auto game_left = game_tot - get_directory_num("./games/") + 2;
 		if (game_left > 0)
 		{
-			vector<thread> thread_vector;
-			int game_cnt_per_thread = game_left / THREAD_NUM;
-			for (int thread_id = 0; thread_id < THREAD_NUM; thread_id++)
-			{
-				thread_vector.push_back(thread(self_play_by_thread, game_cnt_per_thread));
-			}
-			for (int thread_id = 0; thread_id < THREAD_NUM; thread_id++)
-			{
-				thread_vector[thread_id].join();
-			}
+			self_play_games_shared(game_left);
 		}
 		system("bat\\train.bat");
 		if (epoch % CHECKPOINT_FEQ == 0)
@@ -550,6 +672,7 @@ int main()
 {
 	try 
 	{
+		CpuScheduler::get_instance().configure(CPU_CORE_BUDGET, TORCH_THREAD_NUM, {}, CPU_PIN_CORES);
 		train();
 	}
 	catch (exception& e)
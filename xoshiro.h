@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <thread>
+#include <functional>
+
+// xoshiro256** generator, usable with the <random> distributions
+class Xoshiro256 {
+public:
+    using result_type = uint64_t;
+
+    inline explicit Xoshiro256(uint64_t seed = 0) {
+        // expand the seed with splitmix64
+        for (int i = 0; i < 4; i++) {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            this->s[i] = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    inline result_type operator()() {
+        const uint64_t result = rotl(this->s[1] * 5, 7) * 9;
+        const uint64_t t = this->s[1] << 17;
+
+        this->s[2] ^= this->s[0];
+        this->s[3] ^= this->s[1];
+        this->s[1] ^= this->s[2];
+        this->s[0] ^= this->s[3];
+        this->s[2] ^= t;
+        this->s[3] = rotl(this->s[3], 45);
+
+        return result;
+    }
+
+    // uniform double in [0, 1)
+    inline double next_double() { return ((*this)() >> 11) * 0x1.0p-53; }
+
+private:
+    static inline uint64_t rotl(const uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t s[4];
+};
+
+// one generator per thread, seeded from random_device and the thread id
+inline Xoshiro256& get_thread_rng() {
+    thread_local Xoshiro256 rng(
+        (uint64_t(std::random_device{}()) << 32) ^
+        std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    return rng;
+}